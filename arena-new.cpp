@@ -0,0 +1,67 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <new>
+#include <stdlib.h>
+
+#include "macro.h"
+
+/*
+ * Static footprint mode: C++ allocations go to the arena like the others,
+ * without depending on how the C++ runtime implements operator new. The
+ * arena aborts instead of running out, so there's nothing to throw.
+ */
+
+_public_ void *operator new(size_t size)
+{
+    return malloc(size);
+}
+
+_public_ void *operator new[](size_t size)
+{
+    return malloc(size);
+}
+
+_public_ void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return malloc(size);
+}
+
+_public_ void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return malloc(size);
+}
+
+_public_ void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+_public_ void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+_public_ void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+_public_ void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
@@ -0,0 +1,199 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "arena.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "macro.h"
+
+#define ALIGNMENT 16U
+#define BOOTSTRAP_SIZE (512U * 1024U)
+
+/* Precedes each allocation, keeping it aligned: needed by realloc() */
+struct block {
+    size_t size;
+    size_t reserved;
+};
+
+static uint8_t bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(ALIGNMENT)));
+
+static uint8_t *base = bootstrap;
+static size_t len = BOOTSTRAP_SIZE;
+static size_t pos;
+static bool sealed;
+static bool lock;
+
+static void fatal(const char *msg)
+{
+    /* nothing that may allocate */
+    ssize_t r = write(STDERR_FILENO, msg, strlen(msg));
+
+    (void) r;
+    abort();
+}
+
+static void *bump(size_t size, size_t alignment)
+{
+    struct block *b;
+    uintptr_t p;
+
+    if (alignment < ALIGNMENT)
+        alignment = ALIGNMENT;
+
+    while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE)) { }
+
+    if (sealed)
+        fatal("Allocation after startup in static footprint mode\n");
+
+    p = (uintptr_t) base + pos + sizeof(struct block);
+    p = (p + alignment - 1) & ~((uintptr_t) alignment - 1);
+    if (size > len || p + size > (uintptr_t) base + len)
+        fatal(base == bootstrap ? "Static footprint bootstrap area exhausted\n"
+                                : "Static footprint arena exhausted\n");
+
+    pos = p + size - (uintptr_t) base;
+    __atomic_clear(&lock, __ATOMIC_RELEASE);
+
+    b = (struct block *) p - 1;
+    b->size = size;
+
+    return (void *) p;
+}
+
+int arena_init(size_t size)
+{
+    void *p;
+
+    size = (size + 4095U) & ~(size_t) 4095U;
+
+    /* Fault it all in now, rather than in the routing path */
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+             -1, 0);
+    if (p == MAP_FAILED) {
+        log_error_errno(errno, "Could not map arena of %zu bytes (%m)", size);
+        return -1;
+    }
+
+    if (mlock(p, size) < 0)
+        log_debug("Could not lock arena in memory (%m)");
+
+    while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE)) { }
+    base = (uint8_t *) p;
+    len = size;
+    pos = 0;
+    __atomic_clear(&lock, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void arena_set_sealed(bool value)
+{
+    __atomic_store_n(&sealed, value, __ATOMIC_SEQ_CST);
+}
+
+size_t arena_used(void)
+{
+    return base == bootstrap ? 0 : pos;
+}
+
+size_t arena_size(void)
+{
+    return base == bootstrap ? 0 : len;
+}
+
+/*
+ * The replacements must interpose on libc's for the whole process, libc,
+ * the C++ runtime and libmavlink-router included: they are linked into the
+ * executable and exported, even though everything is built with hidden
+ * visibility
+ */
+_public_ void *malloc(size_t size)
+{
+    return bump(size, ALIGNMENT);
+}
+
+_public_ void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    /* Memory is never reused, but the bootstrap area may be from before */
+    p = bump(nmemb * size, ALIGNMENT);
+    memset(p, 0, nmemb * size);
+
+    return p;
+}
+
+_public_ void *realloc(void *ptr, size_t size)
+{
+    size_t old;
+    void *p;
+
+    if (!ptr)
+        return malloc(size);
+
+    old = ((struct block *) ptr - 1)->size;
+    if (size <= old) {
+        ((struct block *) ptr - 1)->size = size;
+        return ptr;
+    }
+
+    p = bump(size, ALIGNMENT);
+    memcpy(p, ptr, old);
+
+    return p;
+}
+
+_public_ void free(void *ptr)
+{
+}
+
+_public_ int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    *memptr = bump(size, alignment);
+    return 0;
+}
+
+_public_ void *aligned_alloc(size_t alignment, size_t size)
+{
+    return bump(size, alignment);
+}
+
+_public_ void *memalign(size_t alignment, size_t size)
+{
+    return bump(size, alignment);
+}
+
+_public_ void *valloc(size_t size)
+{
+    return bump(size, sysconf(_SC_PAGESIZE));
+}
+
+_public_ size_t malloc_usable_size(void *ptr)
+{
+    return ptr ? ((struct block *) ptr - 1)->size : 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Static footprint mode (configure --enable-static-footprint): malloc() and
+ * friends are replaced by a bump allocator over a single arena, mapped and
+ * faulted in at startup with a size computed from the configuration. Once
+ * setup is done the arena is sealed: any allocation after that aborts, so
+ * the routing path can't hit the allocator, and the memory used is known
+ * up front. free() doesn't give memory back, it's only meant for startup.
+ *
+ * Allocations before arena_init(), e.g. by libc or the C++ runtime, come
+ * from a fixed bootstrap area.
+ *
+ * It replaces the allocator of the whole process, so it's part of
+ * mavlink-routerd, not of libmavlink-router: operator new and delete are
+ * replaced too, in arena-new.cpp.
+ */
+
+/* Map the arena, of @size bytes. Further allocations come from it */
+int arena_init(size_t size);
+
+/* Make any allocation abort, or allow them again, e.g. on shutdown */
+void arena_set_sealed(bool sealed);
+
+/* Bytes allocated from the arena, and its size */
+size_t arena_used(void);
+size_t arena_size(void);
+
+#ifdef __cplusplus
+}
+#endif
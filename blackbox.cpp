@@ -0,0 +1,364 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "blackbox.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "log.h"
+
+/*
+ * Record headers and counters are updated after the data they describe is
+ * in place: keep the compiler from reordering them, so the ring is consistent
+ * at any point a fatal signal may hit.
+ */
+#define ordering_barrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+BlackBox::~BlackBox()
+{
+    if (_thread_started) {
+        pthread_mutex_lock(&_lock);
+        _stop = true;
+        pthread_cond_signal(&_cond);
+        pthread_mutex_unlock(&_lock);
+        pthread_join(_thread, NULL);
+    }
+
+    if (_hdr)
+        munmap(_hdr, _map_size);
+    free(_snapshot);
+    free(_path);
+}
+
+int BlackBox::open(const char *path, size_t size)
+{
+    sigset_t all, old;
+    struct stat st;
+    bool reuse;
+    void *p;
+    int fd;
+
+    if (size < sizeof(struct blackbox_record) + 2 * MAVLINK_MAX_PACKET_LEN) {
+        log_error("Blackbox too small: %zu bytes", size);
+        return -EINVAL;
+    }
+
+    fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error_errno(errno, "Could not open blackbox %s (%m)", path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        log_error_errno(errno, "Could not stat blackbox %s (%m)", path);
+        goto fail;
+    }
+
+    _map_size = sizeof(struct blackbox_header) + size;
+    reuse = (size_t)st.st_size == _map_size;
+    if (!reuse && ftruncate(fd, _map_size) < 0) {
+        log_error_errno(errno, "Could not resize blackbox %s (%m)", path);
+        goto fail;
+    }
+
+    p = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        log_error_errno(errno, "Could not map blackbox %s (%m)", path);
+        goto fail;
+    }
+    close(fd);
+
+    _hdr = (struct blackbox_header *)p;
+    _ring = (uint8_t *)p + sizeof(struct blackbox_header);
+
+    /* Keep recording after what a previous run left, if the file is sane */
+    if (!reuse || memcmp(_hdr->magic, BLACKBOX_MAGIC, sizeof(BLACKBOX_MAGIC)) != 0
+        || _hdr->version != BLACKBOX_VERSION || _hdr->size != size
+        || _hdr->head > size || _hdr->tail > size) {
+        memset(_hdr, 0, sizeof(*_hdr));
+        memcpy(_hdr->magic, BLACKBOX_MAGIC, sizeof(BLACKBOX_MAGIC));
+        _hdr->version = BLACKBOX_VERSION;
+        _hdr->header_size = sizeof(struct blackbox_header);
+        _hdr->size = size;
+    }
+
+    _path = strdup(path);
+    snprintf(_crash_path, sizeof(_crash_path), "%s.crash", path);
+
+    _snapshot = (uint8_t *)malloc(size);
+    if (!_snapshot) {
+        log_error("Could not allocate %zu bytes for blackbox dumps", size);
+        return -ENOMEM;
+    }
+
+    /* signals are for the routing thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    _thread_started = pthread_create(&_thread, NULL, _dump_thread, this) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!_thread_started) {
+        log_error("Could not start blackbox dump thread");
+        return -1;
+    }
+
+    /* It logs, so it must get its log ring before memory may be sealed */
+    pthread_mutex_lock(&_lock);
+    while (!_thread_ready)
+        pthread_cond_wait(&_cond, &_lock);
+    pthread_mutex_unlock(&_lock);
+
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Drop the oldest records while they start in [start, end), the range about
+ * to be overwritten
+ */
+void BlackBox::_evict(uint64_t start, uint64_t end)
+{
+    while (_hdr->count > 0 && _hdr->tail >= start && _hdr->tail < end) {
+        uint64_t tail = _hdr->tail;
+        struct blackbox_record *rec = (struct blackbox_record *)(_ring + tail);
+
+        if (_hdr->size - tail < sizeof(*rec) || rec->len == BLACKBOX_WRAP_MARKER) {
+            _hdr->tail = 0;
+            continue;
+        }
+
+        _hdr->tail = tail + sizeof(*rec) + rec->len;
+        _hdr->count--;
+    }
+}
+
+/*
+ * COMMAND_LONG MAV_CMD_USER_1 with param1 = 1, from a GCS to the blackbox of
+ * one of the vehicles, or broadcast
+ */
+bool BlackBox::_is_dump_command(const struct frame_info *frame, const struct buffer *buf)
+{
+    mavlink_message_t msg;
+    mavlink_command_long_t cmd;
+
+    if (frame->target_compid != MAV_COMP_ID_LOG && frame->target_compid != MAV_COMP_ID_ALL)
+        return false;
+
+    if (frame->target_sysid != 0
+        && !(_vehicle_sysids[frame->target_sysid / 32] & (1U << (frame->target_sysid % 32))))
+        return false;
+
+    frame_to_message(buf, &msg);
+    mavlink_msg_command_long_decode(&msg, &cmd);
+
+    return cmd.command == MAV_CMD_USER_1 && cmd.param1 == 1;
+}
+
+void BlackBox::record(const struct frame_info *frame, const struct buffer *buf, bool from_vehicle)
+{
+    const uint64_t len = sizeof(struct blackbox_record) + buf->len;
+    uint64_t head = _hdr->head;
+    struct blackbox_record *rec;
+
+    if (_hdr->size - head < len) {
+        if (_hdr->size - head >= sizeof(*rec)) {
+            _evict(head, head + sizeof(*rec));
+            rec = (struct blackbox_record *)(_ring + head);
+            rec->len = BLACKBOX_WRAP_MARKER;
+        }
+        _evict(head, _hdr->size);
+        head = 0;
+    }
+    _evict(head, head + len);
+    if (_hdr->count == 0)
+        _hdr->tail = head;
+
+    rec = (struct blackbox_record *)(_ring + head);
+    rec->timestamp = frame->rx_timestamp ?: now_realtime_nsec();
+    rec->len = buf->len;
+    rec->endpoint_id = frame->ingress;
+    rec->reserved = 0;
+    memcpy(rec + 1, buf->data, buf->len);
+
+    ordering_barrier();
+    _hdr->head = head + len;
+    _hdr->count++;
+
+    if (from_vehicle)
+        _vehicle_sysids[frame->sysid / 32] |= 1U << (frame->sysid % 32);
+    else if (frame->msgid == MAVLINK_MSG_ID_COMMAND_LONG && _is_dump_command(frame, buf))
+        dump_requested = 1;
+}
+
+/* Write the records of @ring, described by @ring_hdr, to @path, oldest first */
+static int dump_ring(const char *path, const struct blackbox_header *ring_hdr,
+                     const uint8_t *ring)
+{
+    struct blackbox_header hdr = *ring_hdr;
+    uint64_t pos = hdr.tail, span = hdr.tail, total = 0;
+    int fd, r;
+
+    /* The dump is a ring that never wrapped, laid out oldest first */
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -errno;
+
+    for (uint64_t i = 0; i < hdr.count;) {
+        const struct blackbox_record *rec = (const struct blackbox_record *)(ring + pos);
+
+        if (hdr.size - pos < sizeof(*rec) || rec->len == BLACKBOX_WRAP_MARKER) {
+            total += pos - span;
+            pos = span = 0;
+            continue;
+        }
+        pos += sizeof(*rec) + rec->len;
+        i++;
+    }
+    total += pos - span;
+
+    hdr.size = hdr.head = total;
+    hdr.tail = 0;
+    r = write_all(fd, &hdr, sizeof(hdr));
+    if (r < 0)
+        goto end;
+
+    /* Second pass, now writing the at most 2 spans of records */
+    pos = span = ring_hdr->tail;
+    for (uint64_t i = 0; i < hdr.count;) {
+        const struct blackbox_record *rec = (const struct blackbox_record *)(ring + pos);
+
+        if (ring_hdr->size - pos < sizeof(*rec) || rec->len == BLACKBOX_WRAP_MARKER) {
+            r = write_all(fd, ring + span, pos - span);
+            if (r < 0)
+                goto end;
+            pos = span = 0;
+            continue;
+        }
+        pos += sizeof(*rec) + rec->len;
+        i++;
+    }
+    r = write_all(fd, ring + span, pos - span);
+
+end:
+    close(fd);
+    return r;
+}
+
+int BlackBox::dump(const char *path)
+{
+    return dump_ring(path, _hdr, _ring);
+}
+
+int BlackBox::dump()
+{
+    char date[32];
+    struct tm tm;
+    time_t t = time(NULL);
+    bool busy;
+
+    pthread_mutex_lock(&_lock);
+    busy = _dumping;
+    pthread_mutex_unlock(&_lock);
+    if (busy)
+        return -EBUSY;
+
+    dump_requested = 0;
+
+    localtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+    snprintf(_dump_path, sizeof(_dump_path), "%s-%s.dump", _path, date);
+
+    _snapshot_hdr = *_hdr;
+    memcpy(_snapshot, _ring, _hdr->size);
+
+    pthread_mutex_lock(&_lock);
+    _dumping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    return 0;
+}
+
+void *BlackBox::_dump_thread(void *data)
+{
+    ((BlackBox *)data)->_dump_loop();
+
+    return NULL;
+}
+
+void BlackBox::_dump_loop()
+{
+    log_info("Blackbox: recording to %s (%" PRIu64 " bytes, %" PRIu64 " packets kept)", _path,
+             _hdr->size, _hdr->count);
+
+    pthread_mutex_lock(&_lock);
+    _thread_ready = true;
+    pthread_cond_broadcast(&_cond);
+
+    while (true) {
+        int r;
+
+        while (!_dumping && !_stop)
+            pthread_cond_wait(&_cond, &_lock);
+        if (_stop)
+            break;
+        pthread_mutex_unlock(&_lock);
+
+        r = dump_ring(_dump_path, &_snapshot_hdr, _snapshot);
+        if (r < 0)
+            log_error_errno(r, "Could not dump blackbox to %s (%m)", _dump_path);
+        else
+            log_info("Blackbox: %" PRIu64 " packets dumped to %s", _snapshot_hdr.count,
+                     _dump_path);
+
+        pthread_mutex_lock(&_lock);
+        _dumping = false;
+    }
+
+    pthread_mutex_unlock(&_lock);
+}
+
+void BlackBox::dump_on_crash()
+{
+    dump(_crash_path);
+}
+
+void BlackBox::print_statistics()
+{
+    uint64_t used = 0;
+
+    if (_hdr->count > 0)
+        used = _hdr->head > _hdr->tail ? _hdr->head - _hdr->tail
+                                       : _hdr->size - _hdr->tail + _hdr->head;
+
+    printf("Blackbox {"
+           "\n\tpackets: %" PRIu64
+           "\n\tused: %" PRIu64 "/%" PRIu64 " bytes"
+           "\n}"
+           "\n",
+           _hdr->count, used, _hdr->size);
+}
@@ -0,0 +1,145 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+
+#include "comm.h"
+#include "macro.h"
+#include "util.h"
+
+/*
+ * Black box flight recorder: every packet routed is appended to a ring in a
+ * memory-mapped file, with its timestamp and ingress endpoint id. Writing a
+ * packet is a couple of stores and a memcpy, with no syscall or lock. The
+ * file always describes a consistent ring, so it survives a crash of the
+ * router; dump() linearizes it, oldest packet first, into a file with the
+ * same format.
+ *
+ * File layout: struct blackbox_header followed by the ring of records, each
+ * a struct blackbox_record followed by the packet. A record that doesn't fit
+ * at the end of the ring is written at its start, leaving either a wrap
+ * marker or less than a record header behind.
+ *
+ * Dumps are written by a thread of their own, from a copy of the ring taken
+ * when the dump is requested, so the routing thread only pays for a memcpy.
+ */
+struct _packed_ blackbox_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    /* ring size, excluding this header */
+    uint64_t size;
+    /* offsets in the ring of the next record to write and of the oldest */
+    uint64_t head;
+    uint64_t tail;
+    uint64_t count;
+};
+
+struct _packed_ blackbox_record {
+    /* CLOCK_REALTIME the packet was received */
+    uint64_t timestamp;
+    uint16_t len;
+    uint8_t endpoint_id;
+    uint8_t reserved;
+};
+
+#define BLACKBOX_MAGIC "MAVBBOX"
+#define BLACKBOX_VERSION 1
+#define BLACKBOX_WRAP_MARKER 0xffff
+
+/*
+ * The ring takes a write for every packet: keep it in memory, where it still
+ * survives a crash of the router, instead of wearing out flash. Where rings
+ * given by name instead of path go.
+ */
+#define BLACKBOX_DEFAULT_DIR "/dev/shm"
+
+class BlackBox {
+public:
+    BlackBox() { }
+    ~BlackBox();
+
+    /*
+     * Open, or create, a ring of @size bytes backed by the file at @path,
+     * and start the dump thread
+     */
+    int open(const char *path, size_t size);
+
+    /*
+     * @from_vehicle tells whether the packet came from the master endpoint.
+     * The sysids seen from it are the vehicles the blackbox belongs to: a
+     * dump can be requested with a COMMAND_LONG MAV_CMD_USER_1, param1 = 1,
+     * sent to component MAV_COMP_ID_LOG of one of them.
+     */
+    void record(const struct frame_info *frame, const struct buffer *buf, bool from_vehicle);
+
+    /*
+     * Write the packets in the ring to @path, oldest first. Only uses
+     * async-signal-safe functions, so it can be called from a crash handler.
+     */
+    int dump(const char *path);
+
+    /*
+     * Dump to a new file next to the ring, named after the current time.
+     * The ring is copied and the dump thread writes it. Returns -EBUSY while
+     * the previous dump is still being written; the request is kept.
+     */
+    int dump();
+
+    /* Dump to a file next to the ring from a fatal signal handler */
+    void dump_on_crash();
+
+    /* Set when a dump is requested, through MAVLink or a signal */
+    volatile sig_atomic_t dump_requested = 0;
+
+    void print_statistics();
+
+private:
+    void _evict(uint64_t start, uint64_t end);
+    bool _is_dump_command(const struct frame_info *frame, const struct buffer *buf);
+
+    static void *_dump_thread(void *data);
+    void _dump_loop();
+
+    struct blackbox_header *_hdr = nullptr;
+    uint8_t *_ring = nullptr;
+    size_t _map_size = 0;
+    char *_path = nullptr;
+    char _crash_path[PATH_MAX];
+
+    /* bitmap of the sysids of the vehicles */
+    uint32_t _vehicle_sysids[256 / 32] = { };
+
+    /* Copy of the ring for the dump thread, guarded by _lock while _dumping */
+    struct blackbox_header _snapshot_hdr;
+    uint8_t *_snapshot = nullptr;
+    char _dump_path[PATH_MAX];
+
+    pthread_t _thread;
+    bool _thread_started = false;
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t _cond = PTHREAD_COND_INITIALIZER;
+    bool _thread_ready = false;
+    bool _dumping = false;
+    bool _stop = false;
+};
@@ -0,0 +1,749 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "log.h"
+#include "mainloop.h"
+#include "msgmeta.h"
+
+/*
+ * Channel used to build the replies, not shared with anybody else. Its seq
+ * is not used: replies get the seq of the component they come from.
+ */
+#define CACHE_CHANNEL MAVLINK_COMM_1
+
+/* Vehicle considered rebooted or out of reach if its heartbeat stops for this long */
+#define HEARTBEAT_TIMEOUT_USEC (5 * USEC_PER_SEC)
+
+/* Fence and rally points are not cached, only the main mission */
+#define MISSION_TYPE_MISSION 0
+
+/*
+ * mission_type is the first extension of all mission messages. Get it from
+ * the payload so this works with mavlink headers that don't have it yet.
+ */
+static uint8_t mission_type(const mavlink_message_t *msg)
+{
+    const struct msg_meta *meta = msg_meta_get(msg->msgid);
+
+    if (!meta || meta->max_len <= meta->min_len)
+        return MISSION_TYPE_MISSION;
+
+    return (uint8_t)_MAV_PAYLOAD(msg)[meta->min_len];
+}
+
+/*
+ * Scale of x and y in MISSION_ITEM_INT, which is what we store, relative to
+ * MISSION_ITEM
+ */
+static double mission_item_int_scale(uint8_t frame)
+{
+    switch (frame) {
+    case MAV_FRAME_GLOBAL:
+    case MAV_FRAME_GLOBAL_RELATIVE_ALT:
+    case MAV_FRAME_GLOBAL_INT:
+    case MAV_FRAME_GLOBAL_RELATIVE_ALT_INT:
+    case MAV_FRAME_GLOBAL_TERRAIN_ALT:
+    case MAV_FRAME_GLOBAL_TERRAIN_ALT_INT:
+        return 1e7;
+    case MAV_FRAME_MISSION:
+        return 1;
+    default:
+        return 1e4;
+    }
+}
+
+/* Whether component @sysid/@compid is among the targets of a message */
+static bool addressed(uint8_t sysid, uint8_t compid, uint8_t target_sysid,
+                      uint8_t target_compid)
+{
+    return sysid == target_sysid && (target_compid == MAV_COMP_ID_ALL || compid == target_compid);
+}
+
+/* Scaled coordinate of MISSION_ITEM as in MISSION_ITEM_INT, rounded */
+static int32_t mission_item_int_coord(float value, uint8_t frame)
+{
+    double scaled = value * mission_item_int_scale(frame);
+
+    return (int32_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+}
+
+VehicleCache::~VehicleCache()
+{
+    for (unsigned int i = 0; i < _n_components; i++) {
+        free(_components[i].params);
+        free(_components[i].items);
+    }
+
+    free(_components);
+}
+
+struct VehicleCache::component *VehicleCache::_find_component(uint8_t sysid, uint8_t compid)
+{
+    for (unsigned int i = 0; i < _n_components; i++) {
+        if (_components[i].sysid == sysid && _components[i].compid == compid)
+            return &_components[i];
+    }
+
+    return nullptr;
+}
+
+struct VehicleCache::component *VehicleCache::_get_component(uint8_t sysid, uint8_t compid)
+{
+    struct component *c = _find_component(sysid, compid);
+
+    if (c)
+        return c;
+
+    c = (struct component *) realloc(_components, (_n_components + 1) * sizeof(*c));
+    if (!c)
+        return nullptr;
+
+    _components = c;
+    c = &_components[_n_components++];
+    memset(c, 0, sizeof(*c));
+    c->sysid = sysid;
+    c->compid = compid;
+
+    return c;
+}
+
+/*
+ * Component a request to @sysid/@compid is for. MAV_COMP_ID_ALL means the
+ * autopilot, or else any component of the system we have.
+ */
+struct VehicleCache::component *VehicleCache::_find_target(uint8_t sysid, uint8_t compid)
+{
+    struct component *found = nullptr;
+
+    if (compid != MAV_COMP_ID_ALL)
+        return _find_component(sysid, compid);
+
+    for (unsigned int i = 0; i < _n_components; i++) {
+        struct component *c = &_components[i];
+
+        if (c->sysid != sysid)
+            continue;
+        if (c->compid == MAV_COMP_ID_AUTOPILOT1)
+            return c;
+        if (!found)
+            found = c;
+    }
+
+    return found;
+}
+
+struct VehicleCache::param *VehicleCache::_find_param(struct component *c, const char *id)
+{
+    for (unsigned int i = 0; i < c->param_count; i++) {
+        if (strncmp(c->params[i].id, id, sizeof(c->params[i].id)) == 0)
+            return &c->params[i];
+    }
+
+    return nullptr;
+}
+
+void VehicleCache::_invalidate_params(struct component *c)
+{
+    if (c->param_count) {
+        log_debug("Cache: dropping parameters of %u/%u", c->sysid, c->compid);
+        _invalidations++;
+    }
+
+    free(c->params);
+    c->params = nullptr;
+    c->param_count = 0;
+    c->params_known = 0;
+}
+
+void VehicleCache::_invalidate_mission(struct component *c)
+{
+    if (c->item_count_known) {
+        log_debug("Cache: dropping mission of %u/%u", c->sysid, c->compid);
+        _invalidations++;
+    }
+
+    free(c->items);
+    c->items = nullptr;
+    c->item_count = 0;
+    c->items_known = 0;
+    c->item_count_known = false;
+    c->mission_client = nullptr;
+}
+
+void VehicleCache::_invalidate_targets(uint8_t sysid, uint8_t compid, bool params, bool mission)
+{
+    for (unsigned int i = 0; i < _n_components; i++) {
+        struct component *c = &_components[i];
+
+        if (!addressed(c->sysid, c->compid, sysid, compid))
+            continue;
+
+        if (params)
+            _invalidate_params(c);
+        if (mission)
+            _invalidate_mission(c);
+    }
+}
+
+void VehicleCache::_invalidate_message_targets(const mavlink_message_t *msg, bool params,
+                                               bool mission)
+{
+    const struct msg_meta *meta = msg_meta_get(msg->msgid);
+    int sysid, compid;
+
+    if (!meta)
+        return;
+
+    msg_meta_get_target(meta, (const uint8_t *)_MAV_PAYLOAD(msg), msg->len, &sysid, &compid);
+    if (sysid < 0 || compid < 0)
+        return;
+
+    _invalidate_targets(sysid, compid, params, mission);
+}
+
+void VehicleCache::_heartbeat(const mavlink_message_t *msg)
+{
+    struct component *c = _find_component(msg->sysid, msg->compid);
+    usec_t now;
+
+    if (!c)
+        return;
+
+    now = now_usec();
+    if (c->last_heartbeat && now - c->last_heartbeat > HEARTBEAT_TIMEOUT_USEC) {
+        log_info("Cache: lost heartbeat of %u/%u, dropping cached data", c->sysid, c->compid);
+        _invalidate_params(c);
+        _invalidate_mission(c);
+    }
+
+    c->last_heartbeat = now;
+}
+
+void VehicleCache::_param_value(const mavlink_message_t *msg)
+{
+    mavlink_param_value_t value;
+    struct component *c;
+    struct param *p;
+
+    mavlink_msg_param_value_decode(msg, &value);
+
+    if (value.param_count == 0 || value.param_type == 0)
+        return;
+
+    c = _get_component(msg->sysid, msg->compid);
+    if (!c)
+        return;
+
+    if (value.param_count != c->param_count) {
+        _invalidate_params(c);
+
+        c->params = (struct param *) calloc(value.param_count, sizeof(*c->params));
+        if (!c->params)
+            return;
+        c->param_count = value.param_count;
+    }
+
+    /* Replies to PARAM_SET may come without index */
+    if (value.param_index < c->param_count)
+        p = &c->params[value.param_index];
+    else
+        p = _find_param(c, value.param_id);
+    if (!p)
+        return;
+
+    if (!p->type)
+        c->params_known++;
+
+    memcpy(p->id, value.param_id, sizeof(p->id));
+    p->value = value.param_value;
+    p->type = value.param_type;
+}
+
+void VehicleCache::_mission_count(const mavlink_message_t *msg)
+{
+    mavlink_mission_count_t count;
+    struct component *c;
+
+    if (mission_type(msg) != MISSION_TYPE_MISSION)
+        return;
+
+    mavlink_msg_mission_count_decode(msg, &count);
+
+    c = _get_component(msg->sysid, msg->compid);
+    if (!c || (c->item_count_known && c->item_count == count.count))
+        return;
+
+    _invalidate_mission(c);
+
+    if (count.count) {
+        c->items = (mavlink_mission_item_int_t *) calloc(count.count, sizeof(*c->items));
+        if (!c->items)
+            return;
+    }
+    c->item_count = count.count;
+    c->item_count_known = true;
+}
+
+void VehicleCache::_store_mission_item(const mavlink_message_t *msg,
+                                       const mavlink_mission_item_int_t *item)
+{
+    struct component *c;
+
+    if (mission_type(msg) != MISSION_TYPE_MISSION)
+        return;
+
+    c = _find_component(msg->sysid, msg->compid);
+    if (!c || !c->item_count_known)
+        return;
+
+    if (item->seq >= c->item_count || item->command == 0)
+        return;
+
+    if (c->items[item->seq].command == 0)
+        c->items_known++;
+    c->items[item->seq] = *item;
+}
+
+void VehicleCache::_mission_item_int(const mavlink_message_t *msg)
+{
+    mavlink_mission_item_int_t item;
+
+    mavlink_msg_mission_item_int_decode(msg, &item);
+    _store_mission_item(msg, &item);
+}
+
+/* Vehicles that don't support MISSION_ITEM_INT: stored as if they did */
+void VehicleCache::_mission_item(const mavlink_message_t *msg)
+{
+    mavlink_mission_item_t legacy;
+    mavlink_mission_item_int_t item = { };
+
+    mavlink_msg_mission_item_decode(msg, &legacy);
+
+    item.param1 = legacy.param1;
+    item.param2 = legacy.param2;
+    item.param3 = legacy.param3;
+    item.param4 = legacy.param4;
+    item.x = mission_item_int_coord(legacy.x, legacy.frame);
+    item.y = mission_item_int_coord(legacy.y, legacy.frame);
+    item.z = legacy.z;
+    item.seq = legacy.seq;
+    item.command = legacy.command;
+    item.target_system = legacy.target_system;
+    item.target_component = legacy.target_component;
+    item.frame = legacy.frame;
+    item.current = legacy.current;
+    item.autocontinue = legacy.autocontinue;
+
+    _store_mission_item(msg, &item);
+}
+
+void VehicleCache::_mission_current(const mavlink_message_t *msg)
+{
+    mavlink_mission_current_t current;
+    struct component *c = _find_component(msg->sysid, msg->compid);
+
+    if (!c)
+        return;
+
+    mavlink_msg_mission_current_decode(msg, &current);
+    c->mission_current = current.seq;
+}
+
+void VehicleCache::handle_from_vehicle(const struct frame_info *frame, const struct buffer *buf)
+{
+    struct component *c = _find_component(frame->sysid, frame->compid);
+    mavlink_message_t msg;
+
+    if (c)
+        c->last_seq = frame->seq;
+
+    switch (frame->msgid) {
+    case MAVLINK_MSG_ID_HEARTBEAT:
+    case MAVLINK_MSG_ID_PARAM_VALUE:
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+    case MAVLINK_MSG_ID_MISSION_ITEM:
+    case MAVLINK_MSG_ID_MISSION_CURRENT:
+        break;
+    default:
+        return;
+    }
+
+    frame_to_message(buf, &msg);
+
+    switch (msg.msgid) {
+    case MAVLINK_MSG_ID_HEARTBEAT:
+        _heartbeat(&msg);
+        break;
+    case MAVLINK_MSG_ID_PARAM_VALUE:
+        _param_value(&msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+        _mission_count(&msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+        _mission_item_int(&msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_ITEM:
+        _mission_item(&msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_CURRENT:
+        _mission_current(&msg);
+        break;
+    }
+}
+
+void VehicleCache::_send(Endpoint *to, const struct component *c, mavlink_message_t *msg)
+{
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buf;
+
+    buf.data = data;
+    buf.len = mavlink_msg_to_send_buffer(data, msg);
+
+    _mainloop.write_on_behalf(to, &buf, c->last_seq);
+    _msgs_served++;
+}
+
+void VehicleCache::_send_param(Endpoint *to, const struct component *c, uint16_t index)
+{
+    const struct param *p = &c->params[index];
+    mavlink_param_value_t value = { };
+    mavlink_message_t msg;
+
+    memcpy(value.param_id, p->id, sizeof(value.param_id));
+    value.param_value = p->value;
+    value.param_type = p->type;
+    value.param_count = c->param_count;
+    value.param_index = index;
+
+    mavlink_msg_param_value_encode_chan(c->sysid, c->compid, CACHE_CHANNEL, &msg, &value);
+    _send(to, c, &msg);
+}
+
+void VehicleCache::_send_mission_item(Endpoint *to, const struct component *c, uint16_t seq,
+                                      const mavlink_message_t *req)
+{
+    mavlink_mission_item_int_t item = c->items[seq];
+    mavlink_message_t msg;
+
+    item.target_system = req->sysid;
+    item.target_component = req->compid;
+    item.current = seq == c->mission_current;
+
+    if (req->msgid == MAVLINK_MSG_ID_MISSION_REQUEST_INT) {
+        mavlink_msg_mission_item_int_encode_chan(c->sysid, c->compid, CACHE_CHANNEL, &msg, &item);
+    } else {
+        mavlink_mission_item_t legacy = { };
+        double scale = mission_item_int_scale(item.frame);
+
+        legacy.param1 = item.param1;
+        legacy.param2 = item.param2;
+        legacy.param3 = item.param3;
+        legacy.param4 = item.param4;
+        legacy.x = item.x / scale;
+        legacy.y = item.y / scale;
+        legacy.z = item.z;
+        legacy.seq = item.seq;
+        legacy.command = item.command;
+        legacy.target_system = item.target_system;
+        legacy.target_component = item.target_component;
+        legacy.frame = item.frame;
+        legacy.current = item.current;
+        legacy.autocontinue = item.autocontinue;
+
+        mavlink_msg_mission_item_encode_chan(c->sysid, c->compid, CACHE_CHANNEL, &msg, &legacy);
+    }
+
+    _send(to, c, &msg);
+}
+
+bool VehicleCache::_param_request_list(Endpoint *from, const mavlink_message_t *msg)
+{
+    mavlink_param_request_list_t req;
+    unsigned int n = 0;
+
+    mavlink_msg_param_request_list_decode(msg, &req);
+
+    /* Every component addressed replies: all of them must be complete */
+    for (unsigned int i = 0; i < _n_components; i++) {
+        const struct component *c = &_components[i];
+
+        if (!addressed(c->sysid, c->compid, req.target_system, req.target_component)
+            || !c->param_count)
+            continue;
+
+        if (c->params_known < c->param_count)
+            return false;
+        n++;
+    }
+
+    if (!n)
+        return false;
+
+    for (unsigned int i = 0; i < _n_components; i++) {
+        const struct component *c = &_components[i];
+
+        if (!addressed(c->sysid, c->compid, req.target_system, req.target_component))
+            continue;
+
+        for (unsigned int j = 0; j < c->param_count; j++)
+            _send_param(from, c, j);
+    }
+
+    return true;
+}
+
+bool VehicleCache::_param_request_read(Endpoint *from, const mavlink_message_t *msg)
+{
+    mavlink_param_request_read_t req;
+    struct component *c;
+    struct param *p;
+
+    mavlink_msg_param_request_read_decode(msg, &req);
+
+    c = _find_target(req.target_system, req.target_component);
+    if (!c)
+        return false;
+
+    if (req.param_index >= 0)
+        p = req.param_index < c->param_count ? &c->params[req.param_index] : nullptr;
+    else
+        p = _find_param(c, req.param_id);
+    if (!p || !p->type)
+        return false;
+
+    _send_param(from, c, p - c->params);
+
+    return true;
+}
+
+void VehicleCache::_param_set(const mavlink_message_t *msg)
+{
+    mavlink_param_set_t set;
+
+    mavlink_msg_param_set_decode(msg, &set);
+
+    for (unsigned int i = 0; i < _n_components; i++) {
+        struct component *c = &_components[i];
+        struct param *p;
+
+        if (!addressed(c->sysid, c->compid, set.target_system, set.target_component))
+            continue;
+
+        /* Unknown until the vehicle replies with the value it actually took */
+        p = _find_param(c, set.param_id);
+        if (p && p->type) {
+            p->type = 0;
+            c->params_known--;
+        }
+    }
+}
+
+bool VehicleCache::_mission_request_list(Endpoint *from, const mavlink_message_t *msg)
+{
+    mavlink_mission_request_list_t req;
+    mavlink_mission_count_t count = { };
+    mavlink_message_t reply;
+    struct component *c;
+
+    if (mission_type(msg) != MISSION_TYPE_MISSION)
+        return false;
+
+    mavlink_msg_mission_request_list_decode(msg, &req);
+
+    c = _find_target(req.target_system, req.target_component);
+    if (!c || !c->item_count_known || c->items_known < c->item_count)
+        return false;
+
+    count.count = c->item_count;
+    count.target_system = msg->sysid;
+    count.target_component = msg->compid;
+    mavlink_msg_mission_count_encode_chan(c->sysid, c->compid, CACHE_CHANNEL, &reply, &count);
+    _send(from, c, &reply);
+
+    c->mission_client = from;
+
+    return true;
+}
+
+bool VehicleCache::_mission_request(Endpoint *from, const mavlink_message_t *msg)
+{
+    struct component *c;
+    uint16_t seq;
+
+    if (mission_type(msg) != MISSION_TYPE_MISSION)
+        return false;
+
+    /* MISSION_REQUEST and MISSION_REQUEST_INT have the same layout */
+    if (msg->msgid == MAVLINK_MSG_ID_MISSION_REQUEST_INT) {
+        mavlink_mission_request_int_t req;
+
+        mavlink_msg_mission_request_int_decode(msg, &req);
+        c = _find_target(req.target_system, req.target_component);
+        seq = req.seq;
+    } else {
+        mavlink_mission_request_t req;
+
+        mavlink_msg_mission_request_decode(msg, &req);
+        c = _find_target(req.target_system, req.target_component);
+        seq = req.seq;
+    }
+
+    if (!c || c->mission_client != from || seq >= c->item_count)
+        return false;
+
+    _send_mission_item(from, c, seq, msg);
+
+    return true;
+}
+
+bool VehicleCache::_mission_ack(Endpoint *from, const mavlink_message_t *msg)
+{
+    mavlink_mission_ack_t ack;
+    struct component *c;
+
+    mavlink_msg_mission_ack_decode(msg, &ack);
+
+    /* End of a download we served: the vehicle doesn't know about it */
+    c = _find_target(ack.target_system, ack.target_component);
+    if (!c || c->mission_client != from)
+        return false;
+
+    c->mission_client = nullptr;
+
+    return true;
+}
+
+bool VehicleCache::handle_to_vehicle(Endpoint *from, const struct frame_info *frame,
+                                     const struct buffer *buf)
+{
+    mavlink_message_t msg;
+    mavlink_status_t *status;
+    bool served = false;
+
+    switch (frame->msgid) {
+    case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+    case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+    case MAVLINK_MSG_ID_PARAM_SET:
+    case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
+    case MAVLINK_MSG_ID_MISSION_REQUEST:
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT:
+    case MAVLINK_MSG_ID_MISSION_ACK:
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+    case MAVLINK_MSG_ID_MISSION_ITEM:
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+    case MAVLINK_MSG_ID_MISSION_CLEAR_ALL:
+    case MAVLINK_MSG_ID_COMMAND_LONG:
+        break;
+    default:
+        return false;
+    }
+
+    frame_to_message(buf, &msg);
+
+    /* Reply with the same mavlink version the request came in */
+    status = mavlink_get_channel_status(CACHE_CHANNEL);
+    if (msg.magic == MAVLINK_STX_MAVLINK1)
+        status->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+    else
+        status->flags &= ~MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+
+    switch (msg.msgid) {
+    case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+        served = _param_request_list(from, &msg);
+        break;
+    case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+        served = _param_request_read(from, &msg);
+        break;
+    case MAVLINK_MSG_ID_PARAM_SET:
+        _param_set(&msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
+        served = _mission_request_list(from, &msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_REQUEST:
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT:
+        served = _mission_request(from, &msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_ACK:
+        served = _mission_ack(from, &msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+    case MAVLINK_MSG_ID_MISSION_ITEM:
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+        /* Mission upload */
+        if (mission_type(&msg) == MISSION_TYPE_MISSION)
+            _invalidate_message_targets(&msg, false, true);
+        break;
+    case MAVLINK_MSG_ID_MISSION_CLEAR_ALL:
+        _invalidate_message_targets(&msg, false, true);
+        break;
+    case MAVLINK_MSG_ID_COMMAND_LONG: {
+        mavlink_command_long_t cmd;
+
+        mavlink_msg_command_long_decode(&msg, &cmd);
+        if (cmd.command == MAV_CMD_PREFLIGHT_REBOOT_SHUTDOWN)
+            _invalidate_targets(cmd.target_system, cmd.target_component, true, true);
+        break;
+    }
+    }
+
+    if (served)
+        _requests_served++;
+
+    return served;
+}
+
+void VehicleCache::forget_endpoint(const Endpoint *e)
+{
+    for (unsigned int i = 0; i < _n_components; i++) {
+        if (_components[i].mission_client == e)
+            _components[i].mission_client = nullptr;
+    }
+}
+
+void VehicleCache::print_statistics()
+{
+    printf("Cache {"
+           "\n\trequests served: %u" \
+           "\n\tmessages served: %u" \
+           "\n\tinvalidations: %u" \
+           "\n}" \
+           "\n",
+           _requests_served, _msgs_served, _invalidations);
+
+    for (unsigned int i = 0; i < _n_components; i++) {
+        const struct component *c = &_components[i];
+
+        printf("Cache of %u/%u {" \
+               "\n\tparameters: %u/%u" \
+               "\n\tmission items: %u/%u%s" \
+               "\n}" \
+               "\n",
+               c->sysid, c->compid, c->params_known, c->param_count,
+               c->items_known, c->item_count, c->item_count_known ? "" : " (unknown count)");
+    }
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <mavlink.h>
+
+#include "comm.h"
+#include "util.h"
+
+class Mainloop;
+
+/*
+ * Parameter and mission cache. It sits in the forwarding path and snoops
+ * the parameters and the mission the vehicle sends to whoever asks for them.
+ * Once the whole list of a component is known, requests from the other
+ * endpoints are answered from memory and never reach the vehicle, so a new
+ * GCS connecting doesn't pull 1000+ PARAM_VALUEs over the radio again.
+ *
+ * Requests to MAV_COMP_ID_ALL, which is what GCSes usually send, are for the
+ * autopilot, or else for whatever component of the system is cached; a
+ * PARAM_REQUEST_LIST to it is served with the parameters of all of them.
+ * The mission is snooped from MISSION_ITEM_INT or MISSION_ITEM, whichever
+ * the vehicle uses, and served in the form it's requested in. Replies take
+ * the seq of the vehicle component they come from, see
+ * Mainloop::write_on_behalf().
+ *
+ * Cached data of a component is thrown away when it may be stale: the
+ * parameter count changes, the vehicle is asked to reboot or its heartbeat
+ * disappears for a while. Writes (PARAM_SET, mission uploads) are always
+ * forwarded and invalidate what they touch until the vehicle confirms the
+ * new value.
+ */
+class VehicleCache {
+public:
+    VehicleCache(Mainloop &mainloop) : _mainloop(mainloop) { }
+    ~VehicleCache();
+
+    /* Snoop packet sent by the vehicle, i.e. read from the master endpoint */
+    void handle_from_vehicle(const struct frame_info *frame, const struct buffer *buf);
+
+    /*
+     * Look at packet from @from going to the vehicle. Returns true if it
+     * was answered from the cache and must not be forwarded.
+     */
+    bool handle_to_vehicle(Endpoint *from, const struct frame_info *frame,
+                           const struct buffer *buf);
+
+    /* @e is about to be deleted, stop serving it */
+    void forget_endpoint(const Endpoint *e);
+
+    void print_statistics();
+
+private:
+    struct param {
+        char id[16];
+        float value;
+        /* MAV_PARAM_TYPE_*, 0 while the value is not known */
+        uint8_t type;
+    };
+
+    struct component {
+        uint8_t sysid;
+        uint8_t compid;
+        /* seq of the last packet from it, for the replies */
+        uint8_t last_seq;
+        usec_t last_heartbeat;
+
+        /* indexed by param_index */
+        struct param *params;
+        uint16_t param_count;
+        uint16_t params_known;
+
+        /* items of the main mission, indexed by seq; command 0 if not known */
+        mavlink_mission_item_int_t *items;
+        uint16_t item_count;
+        uint16_t items_known;
+        bool item_count_known;
+        uint16_t mission_current;
+        /* endpoint whose mission download we are serving */
+        const Endpoint *mission_client;
+    };
+
+    struct component *_find_component(uint8_t sysid, uint8_t compid);
+    struct component *_get_component(uint8_t sysid, uint8_t compid);
+    struct component *_find_target(uint8_t sysid, uint8_t compid);
+    struct param *_find_param(struct component *c, const char *id);
+    void _invalidate_params(struct component *c);
+    void _invalidate_mission(struct component *c);
+    void _invalidate_targets(uint8_t sysid, uint8_t compid, bool params, bool mission);
+    void _invalidate_message_targets(const mavlink_message_t *msg, bool params, bool mission);
+
+    void _heartbeat(const mavlink_message_t *msg);
+    void _param_value(const mavlink_message_t *msg);
+    void _mission_count(const mavlink_message_t *msg);
+    void _mission_item_int(const mavlink_message_t *msg);
+    void _mission_item(const mavlink_message_t *msg);
+    void _store_mission_item(const mavlink_message_t *msg, const mavlink_mission_item_int_t *item);
+    void _mission_current(const mavlink_message_t *msg);
+
+    bool _param_request_list(Endpoint *from, const mavlink_message_t *msg);
+    bool _param_request_read(Endpoint *from, const mavlink_message_t *msg);
+    void _param_set(const mavlink_message_t *msg);
+    bool _mission_request_list(Endpoint *from, const mavlink_message_t *msg);
+    bool _mission_request(Endpoint *from, const mavlink_message_t *msg);
+    bool _mission_ack(Endpoint *from, const mavlink_message_t *msg);
+
+    void _send_param(Endpoint *to, const struct component *c, uint16_t index);
+    void _send_mission_item(Endpoint *to, const struct component *c, uint16_t seq,
+                            const mavlink_message_t *req);
+    void _send(Endpoint *to, const struct component *c, mavlink_message_t *msg);
+
+    Mainloop &_mainloop;
+
+    struct component *_components = nullptr;
+    unsigned int _n_components = 0;
+
+    uint32_t _requests_served = 0;
+    uint32_t _msgs_served = 0;
+    uint32_t _invalidations = 0;
+};
@@ -0,0 +1,600 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "capture.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "log.h"
+#include "mainloop.h"
+
+/* Packets routed per call of flush_pending_msgs() when replaying at max speed */
+#define MAX_REPLAY_BATCH 64
+
+static void write_header(struct capture_header *hdr, const char *magic)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, magic, sizeof(hdr->magic));
+    hdr->version = CAPTURE_VERSION;
+    hdr->header_size = sizeof(*hdr);
+}
+
+static bool check_header(const struct capture_header *hdr, const char *magic)
+{
+    return memcmp(hdr->magic, magic, sizeof(hdr->magic)) == 0
+        && hdr->version == CAPTURE_VERSION && hdr->header_size >= sizeof(*hdr);
+}
+
+/* Size of the frame at @data, 0 if it's not the start of a frame */
+static size_t frame_size(const uint8_t *data, size_t len)
+{
+    if (len < 3)
+        return 0;
+
+    if (data[0] == MAVLINK_STX_MAVLINK1)
+        return sizeof(struct mavlink_router_mavlink1_header) + data[1] + 2;
+
+    if (data[0] == MAVLINK_STX) {
+        size_t size = sizeof(struct mavlink_router_mavlink2_header) + data[1] + 2;
+        if (data[2] & MAVLINK_IFLAG_SIGNED)
+            size += MAVLINK_SIGNATURE_BLOCK_LEN;
+        return size;
+    }
+
+    return 0;
+}
+
+Capture::~Capture()
+{
+    close();
+}
+
+int Capture::open(const char *path)
+{
+    struct capture_header hdr;
+    char index_path[PATH_MAX];
+
+    _fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        log_error_errno(errno, "Could not open capture %s (%m)", path);
+        return -1;
+    }
+
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    _index_fd = ::open(index_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_index_fd < 0) {
+        log_error_errno(errno, "Could not open capture index %s (%m)", index_path);
+        goto fail;
+    }
+
+    write_header(&hdr, CAPTURE_MAGIC);
+    if (write_all(_fd, &hdr, sizeof(hdr)) < 0)
+        goto fail;
+    write_header(&hdr, CAPTURE_INDEX_MAGIC);
+    if (write_all(_index_fd, &hdr, sizeof(hdr)) < 0)
+        goto fail;
+
+    _offset = sizeof(hdr);
+    _buf = (uint8_t *) malloc(CAPTURE_BLOCK_SIZE);
+    assert(_buf);
+
+    log_info("Capturing to %s", path);
+
+    return 0;
+
+fail:
+    log_error_errno(errno, "Could not write capture %s (%m)", path);
+    ::close(_fd);
+    _fd = -1;
+    if (_index_fd >= 0) {
+        ::close(_index_fd);
+        _index_fd = -1;
+    }
+    return -1;
+}
+
+int Capture::_flush()
+{
+    int r;
+
+    if (_len == 0)
+        return 0;
+
+    /*
+     * The index entry only goes after the block it points to, so an index
+     * never refers to data that is not in the capture
+     */
+    r = write_all(_fd, _buf, _len);
+    if (r == 0)
+        r = write_all(_index_fd, &_entry, sizeof(_entry));
+    if (r < 0)
+        _write_errors++;
+
+    _offset += _len;
+    _len = 0;
+
+    return r;
+}
+
+void Capture::record(const struct frame_info *frame, const struct buffer *buf)
+{
+    struct blackbox_record *rec;
+    const nsec_t timestamp = frame->rx_timestamp ?: now_realtime_nsec();
+
+    if (_len + sizeof(*rec) + buf->len > CAPTURE_BLOCK_SIZE)
+        _flush();
+
+    if (_len == 0) {
+        memset(&_entry, 0, sizeof(_entry));
+        _entry.timestamp = timestamp;
+        _entry.offset = _offset;
+    }
+
+    rec = (struct blackbox_record *)(_buf + _len);
+    rec->timestamp = timestamp;
+    rec->len = buf->len;
+    rec->endpoint_id = frame->ingress;
+    rec->reserved = 0;
+    memcpy(rec + 1, buf->data, buf->len);
+    _len += sizeof(*rec) + buf->len;
+
+    _entry.msgids[(frame->msgid % 256) / 8] |= 1 << (frame->msgid % 8);
+    _packets++;
+}
+
+int Capture::close()
+{
+    int r;
+
+    if (_fd < 0)
+        return 0;
+
+    r = _flush();
+
+    ::close(_fd);
+    ::close(_index_fd);
+    _fd = _index_fd = -1;
+    free(_buf);
+    _buf = nullptr;
+
+    return r;
+}
+
+void Capture::print_statistics()
+{
+    printf("Capture {"
+           "\n\tpackets: %" PRIu64
+           "\n\tbytes: %" PRIu64
+           "\n\twrite errors: %u"
+           "\n}"
+           "\n",
+           _packets, _offset + _len, _write_errors);
+}
+
+ReplayEndpoint::ReplayEndpoint(Mainloop &loop)
+    : Endpoint{"Replay", false}
+    , _mainloop{loop}
+{
+}
+
+ReplayEndpoint::~ReplayEndpoint()
+{
+    if (_map)
+        munmap(_map, _map_size);
+    free(_index);
+}
+
+int ReplayEndpoint::open(const char *path)
+{
+    struct stat st;
+    void *p;
+    int file_fd;
+
+    file_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        log_error_errno(errno, "Could not open capture %s (%m)", path);
+        return -1;
+    }
+
+    if (fstat(file_fd, &st) < 0) {
+        log_error_errno(errno, "Could not stat capture %s (%m)", path);
+        goto fail;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct capture_header)) {
+        log_error("Invalid capture %s", path);
+        goto fail;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    if (p == MAP_FAILED) {
+        log_error_errno(errno, "Could not map capture %s (%m)", path);
+        goto fail;
+    }
+    ::close(file_fd);
+
+    _map = (uint8_t *)p;
+    _map_size = st.st_size;
+
+    if (!check_header((struct capture_header *)_map, CAPTURE_MAGIC)) {
+        log_error("Invalid capture %s", path);
+        return -1;
+    }
+
+    madvise(_map, _map_size, MADV_SEQUENTIAL);
+
+    if (_load_index(path) < 0)
+        return -1;
+
+    log_info("Replaying %s: %zu bytes, %zu index blocks", path, _map_size, _n_index);
+
+    seek(0);
+
+    return 0;
+
+fail:
+    ::close(file_fd);
+    return -1;
+}
+
+size_t ReplayEndpoint::footprint(const char *path)
+{
+    struct stat st;
+    size_t blocks;
+
+    if (stat(path, &st) < 0)
+        return 0;
+
+    /* Index entries, possibly reallocated while being rebuilt */
+    blocks = st.st_size / CAPTURE_BLOCK_SIZE + 16;
+    return Endpoint::footprint(0) + 4 * blocks * sizeof(struct capture_index_entry);
+}
+
+int ReplayEndpoint::_load_index(const char *path)
+{
+    const size_t header_size = ((struct capture_header *)_map)->header_size;
+    char index_path[PATH_MAX];
+    struct capture_header hdr;
+    size_t allocated = 0, pos;
+    int file_fd;
+
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    file_fd = ::open(index_path, O_RDONLY | O_CLOEXEC);
+    if (file_fd >= 0) {
+        struct stat st;
+
+        if (fstat(file_fd, &st) == 0 && (size_t)st.st_size >= sizeof(hdr)
+            && read(file_fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+            && check_header(&hdr, CAPTURE_INDEX_MAGIC)
+            && lseek(file_fd, hdr.header_size, SEEK_SET) >= 0) {
+            allocated = (st.st_size - hdr.header_size) / sizeof(struct capture_index_entry);
+            _index = (struct capture_index_entry *) malloc(
+                (allocated + 1) * sizeof(struct capture_index_entry));
+            assert(_index);
+
+            ssize_t r = read(file_fd, _index, allocated * sizeof(struct capture_index_entry));
+            _n_index = r > 0 ? r / sizeof(struct capture_index_entry) : 0;
+        } else {
+            log_warning("Invalid capture index %s, rebuilding it", index_path);
+        }
+        ::close(file_fd);
+    }
+
+    /* Drop entries that don't make sense, e.g. from another capture */
+    for (size_t i = 0; i < _n_index; i++) {
+        if (_index[i].offset < header_size || _index[i].offset >= _map_size
+            || (i > 0 && _index[i].offset <= _index[i - 1].offset)) {
+            _n_index = i;
+            break;
+        }
+    }
+
+    /*
+     * Rebuild the index from the start of the last block it has: that
+     * block and whatever was written after the index is not indexed yet
+     */
+    if (_n_index > 0) {
+        _n_index--;
+        pos = _index[_n_index].offset;
+    } else {
+        pos = header_size;
+    }
+
+    while (pos + sizeof(struct blackbox_record) <= _map_size) {
+        const struct blackbox_record *rec = (const struct blackbox_record *)(_map + pos);
+        const struct buffer buf = { rec->len, (uint8_t *)(rec + 1) };
+        struct capture_index_entry *e;
+        struct frame_info frame;
+
+        /* packet cut short, e.g. by a crash while capturing */
+        if (rec->len == 0 || pos + sizeof(*rec) + rec->len > _map_size)
+            break;
+
+        if (_n_index == 0 || pos - _index[_n_index - 1].offset >= CAPTURE_BLOCK_SIZE) {
+            if (_n_index >= allocated) {
+                allocated = allocated * 2 + 16;
+                _index = (struct capture_index_entry *) realloc(
+                    _index, allocated * sizeof(struct capture_index_entry));
+                assert(_index);
+            }
+            e = &_index[_n_index++];
+            memset(e, 0, sizeof(*e));
+            e->timestamp = rec->timestamp;
+            e->offset = pos;
+        }
+
+        e = &_index[_n_index - 1];
+        frame_parse_header(buf.data, &frame);
+        e->msgids[(frame.msgid % 256) / 8] |= 1 << (frame.msgid % 8);
+
+        pos += sizeof(*rec) + rec->len;
+    }
+
+    /* Ignore a packet cut short at the end */
+    _map_size = pos;
+
+    return 0;
+}
+
+nsec_t ReplayEndpoint::start_timestamp() const
+{
+    return _n_index > 0 ? _index[0].timestamp : 0;
+}
+
+void ReplayEndpoint::seek(nsec_t timestamp)
+{
+    size_t lo = 0, hi = _n_index;
+
+    /* last block starting at or before @timestamp */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (_index[mid].timestamp <= timestamp)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    _block = lo;
+    _pos = _n_index > 0 ? _index[lo].offset : _map_size;
+
+    while (_pos < _map_size) {
+        const struct blackbox_record *rec = (const struct blackbox_record *)(_map + _pos);
+
+        if (rec->timestamp >= timestamp)
+            break;
+        _pos += sizeof(*rec) + rec->len;
+    }
+
+    _done = false;
+    _base_time = now_usec();
+    _base_timestamp = _pos < _map_size ? ((const struct blackbox_record *)(_map + _pos))->timestamp
+                                       : timestamp;
+    _schedule();
+}
+
+/* Time on the monotonic clock the packet at _pos is due */
+void ReplayEndpoint::_schedule()
+{
+    const struct blackbox_record *rec = (const struct blackbox_record *)(_map + _pos);
+    nsec_t elapsed;
+
+    if (_pos >= _map_size) {
+        if (!_done)
+            log_info("Replay finished: %" PRIu64 " packets", _replayed);
+        _done = true;
+        _flush_deadline = USEC_INFINITY;
+        return;
+    }
+
+    if (_speed <= 0) {
+        _flush_deadline = 0;
+        return;
+    }
+
+    /* packets from other endpoints may be a bit out of order: send them right away */
+    elapsed = rec->timestamp > _base_timestamp ? rec->timestamp - _base_timestamp : 0;
+    _flush_deadline = _base_time + (usec_t)(elapsed / _speed / NSEC_PER_USEC);
+}
+
+int ReplayEndpoint::flush_pending_msgs()
+{
+    const usec_t now = now_usec();
+
+    for (unsigned int i = 0; i < MAX_REPLAY_BATCH && _pos < _map_size; i++) {
+        const struct blackbox_record *rec = (const struct blackbox_record *)(_map + _pos);
+        const struct buffer buf = { rec->len, (uint8_t *)(rec + 1) };
+        struct frame_info frame;
+
+        if (_block + 1 < _n_index && _pos >= _index[_block + 1].offset)
+            _block++;
+
+        /* skip whole blocks without the message we want */
+        if (_msgid >= 0 && !(_index[_block].msgids[(_msgid % 256) / 8] & (1 << (_msgid % 8)))) {
+            _pos = _block + 1 < _n_index ? _index[_block + 1].offset : _map_size;
+            continue;
+        }
+
+        _schedule();
+        if (_flush_deadline > now)
+            return 0;
+
+        _pos += sizeof(*rec) + rec->len;
+
+        if (_source >= 0 && rec->endpoint_id != _source)
+            continue;
+
+        _rx_timestamp = now_realtime_nsec();
+        frame_parse(&buf, id, _rx_timestamp, &frame);
+        if (_msgid >= 0 && frame.msgid != (uint32_t)_msgid)
+            continue;
+
+        _read_total++;
+        _mainloop.route_msg(this, &buf, &frame);
+        _replayed++;
+    }
+
+    _schedule();
+
+    return 0;
+}
+
+void ReplayEndpoint::print_statistics()
+{
+    printf("Replay {"
+           "\n\tpackets: %" PRIu64
+           "\n\tprogress: %zu/%zu bytes"
+           "\n}"
+           "\n",
+           _replayed, _pos, _map_size);
+}
+
+int capture_import_tlog(const char *tlog_path, const char *capture_path)
+{
+    struct frame_info frame;
+    struct buffer buf;
+    struct stat st;
+    Capture capture;
+    uint8_t *map;
+    size_t pos = 0;
+    int fd, r;
+
+    fd = ::open(tlog_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error_errno(errno, "Could not open %s (%m)", tlog_path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        log_error("Invalid tlog %s", tlog_path);
+        ::close(fd);
+        return -1;
+    }
+
+    map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        log_error_errno(errno, "Could not map %s (%m)", tlog_path);
+        return -1;
+    }
+
+    if (capture.open(capture_path) < 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* tlog: each frame is prefixed by its big endian timestamp in us */
+    while (pos + sizeof(uint64_t) < (size_t)st.st_size) {
+        uint64_t timestamp;
+        size_t len;
+
+        memcpy(&timestamp, map + pos, sizeof(timestamp));
+        timestamp = be64toh(timestamp);
+        pos += sizeof(timestamp);
+
+        len = frame_size(map + pos, st.st_size - pos);
+        if (len == 0 || pos + len > (size_t)st.st_size) {
+            log_warning("Invalid frame in %s at offset %zu, stopping", tlog_path, pos);
+            break;
+        }
+
+        buf.data = map + pos;
+        buf.len = len;
+        frame_parse(&buf, 0, timestamp * NSEC_PER_USEC, &frame);
+        capture.record(&frame, &buf);
+        pos += len;
+    }
+
+    r = capture.close();
+    munmap(map, st.st_size);
+
+    return r;
+}
+
+int capture_export_tlog(const char *capture_path, const char *tlog_path)
+{
+    uint8_t *map;
+    struct stat st;
+    size_t pos;
+    int fd, out, r = 0;
+
+    fd = ::open(capture_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error_errno(errno, "Could not open %s (%m)", capture_path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct capture_header)) {
+        log_error("Invalid capture %s", capture_path);
+        ::close(fd);
+        return -1;
+    }
+
+    map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        log_error_errno(errno, "Could not map %s (%m)", capture_path);
+        return -1;
+    }
+
+    if (!check_header((struct capture_header *)map, CAPTURE_MAGIC)) {
+        log_error("Invalid capture %s", capture_path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    out = ::open(tlog_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        log_error_errno(errno, "Could not open %s (%m)", tlog_path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    pos = ((struct capture_header *)map)->header_size;
+    while (pos + sizeof(struct blackbox_record) <= (size_t)st.st_size) {
+        const struct blackbox_record *rec = (const struct blackbox_record *)(map + pos);
+        uint64_t timestamp = htobe64(rec->timestamp / NSEC_PER_USEC);
+
+        if (rec->len == 0 || pos + sizeof(*rec) + rec->len > (size_t)st.st_size)
+            break;
+
+        r = write_all(out, &timestamp, sizeof(timestamp));
+        if (r == 0)
+            r = write_all(out, rec + 1, rec->len);
+        if (r < 0) {
+            log_error_errno(r, "Could not write %s (%m)", tlog_path);
+            break;
+        }
+
+        pos += sizeof(*rec) + rec->len;
+    }
+
+    ::close(out);
+    munmap(map, st.st_size);
+
+    return r;
+}
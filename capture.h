@@ -0,0 +1,152 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "blackbox.h"
+#include "comm.h"
+#include "macro.h"
+#include "util.h"
+
+class Mainloop;
+
+/*
+ * Capture of the traffic routed, to be replayed later. Append-only: a
+ * struct capture_header followed by the packets, each prefixed by a struct
+ * blackbox_record with its CLOCK_REALTIME timestamp in ns, length and
+ * ingress endpoint id, like in the black box.
+ *
+ * A sparse index is appended to <path>.idx: one struct capture_index_entry
+ * per CAPTURE_BLOCK_SIZE bytes of capture, with the timestamp and offset of
+ * the first packet of the block and the msgids found in it, so replay can
+ * seek in O(log n) and skip blocks without the messages it wants. A capture
+ * whose index is missing or was cut short by a crash is still usable: the
+ * rest of the index is rebuilt in memory when it's opened.
+ */
+struct _packed_ capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+};
+
+struct _packed_ capture_index_entry {
+    uint64_t timestamp;
+    uint64_t offset;
+    /* bit (msgid % 256) is set if the block has a packet with that msgid */
+    uint8_t msgids[32];
+};
+
+#define CAPTURE_MAGIC "MAVCAPT"
+#define CAPTURE_INDEX_MAGIC "MAVCIDX"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BLOCK_SIZE (64 * 1024)
+
+class Capture {
+public:
+    Capture() { }
+    ~Capture();
+
+    int open(const char *path);
+    void record(const struct frame_info *frame, const struct buffer *buf);
+    /* Write what's buffered and the index entry of the last block */
+    int close();
+
+    void print_statistics();
+
+private:
+    int _flush();
+
+    int _fd = -1;
+    int _index_fd = -1;
+    /* packets are written in blocks of CAPTURE_BLOCK_SIZE */
+    uint8_t *_buf = nullptr;
+    size_t _len = 0;
+    uint64_t _offset = 0;
+    struct capture_index_entry _entry = { };
+
+    uint64_t _packets = 0;
+    uint32_t _write_errors = 0;
+};
+
+/*
+ * Replays a capture as if its packets were read from this endpoint, at
+ * their original pace multiplied by a speed factor, or as fast as the router
+ * can take them with a speed of 0. The capture is mmapped and packets are
+ * routed straight from it. Packets routed to this endpoint are discarded.
+ */
+class _public_ ReplayEndpoint : public Endpoint {
+public:
+    ReplayEndpoint(Mainloop &loop);
+    virtual ~ReplayEndpoint();
+
+    int open(const char *path);
+
+    /* Upper bound of the memory used to replay the capture at @path */
+    static size_t footprint(const char *path);
+
+    /* Only replay packets captured from @endpoint_id, -1 for all */
+    void set_source(int endpoint_id) { _source = endpoint_id; }
+    void set_speed(double speed) { _speed = speed; }
+    /* Continue from the first packet captured at or after @timestamp */
+    void seek(nsec_t timestamp);
+    /* Only replay packets with this msgid, -1 for all */
+    void set_msgid(int msgid) { _msgid = msgid; }
+    /* Timestamp of the first packet of the capture */
+    nsec_t start_timestamp() const;
+
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override
+    {
+        return pbuf->len;
+    }
+    /* Route the packets that are due */
+    int flush_pending_msgs() override;
+    void print_statistics() override;
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
+
+    int _load_index(const char *path);
+    void _schedule();
+
+    Mainloop &_mainloop;
+
+    uint8_t *_map = nullptr;
+    size_t _map_size = 0;
+    struct capture_index_entry *_index = nullptr;
+    size_t _n_index = 0;
+
+    /* position in the capture and index block it belongs to */
+    size_t _pos = 0;
+    size_t _block = 0;
+    int _source = 0;
+    int _msgid = -1;
+    double _speed = 1;
+
+    /* timestamp of the capture matching _base_time on the monotonic clock */
+    nsec_t _base_timestamp = 0;
+    usec_t _base_time = 0;
+
+    uint64_t _replayed = 0;
+    bool _done = false;
+};
+
+/* Convert between captures and the tlog format used by ground stations */
+_public_ int capture_import_tlog(const char *tlog_path, const char *capture_path);
+_public_ int capture_export_tlog(const char *capture_path, const char *tlog_path);
@@ -0,0 +1,266 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "coalesce.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mavlink.h>
+
+#include "frame.h"
+#include "mainloop.h"
+#include "msgmeta.h"
+
+/*
+ * Copies of a command received within this long after it was forwarded are
+ * suppressed. Retries after it go to the vehicle, in case the command or
+ * its ACK was lost.
+ */
+#define INFLIGHT_USEC (1 * USEC_PER_SEC)
+
+/* A command nobody answered or retried for this long is forgotten */
+#define STALE_USEC (5 * USEC_PER_SEC)
+
+static void command_params(const mavlink_command_long_t *cmd, float params[7])
+{
+    params[0] = cmd->param1;
+    params[1] = cmd->param2;
+    params[2] = cmd->param3;
+    params[3] = cmd->param4;
+    params[4] = cmd->param5;
+    params[5] = cmd->param6;
+    params[6] = cmd->param7;
+}
+
+void CommandCoalescer::_add_requester(struct command *c, Endpoint *endpoint,
+                                      uint8_t sysid, uint8_t compid)
+{
+    for (unsigned int i = 0; i < c->n_requesters; i++) {
+        const struct requester *r = &c->requesters[i];
+
+        if (r->endpoint == endpoint && r->sysid == sysid && r->compid == compid)
+            return;
+    }
+
+    /*
+     * Whoever doesn't fit gets no copy of the ACK, only the original if
+     * it's on the way to it
+     */
+    if (c->n_requesters == COALESCE_MAX_REQUESTERS) {
+        _requesters_dropped_total++;
+        return;
+    }
+
+    c->requesters[c->n_requesters++] = { endpoint, sysid, compid };
+}
+
+bool CommandCoalescer::handle_to_vehicle(Endpoint *from, const struct frame_info *frame,
+                                         const struct buffer *buf)
+{
+    mavlink_command_long_t cmd;
+    mavlink_message_t msg;
+    struct command *slot = nullptr;
+    float params[7];
+    usec_t now;
+
+    if (frame->msgid != MAVLINK_MSG_ID_COMMAND_LONG)
+        return false;
+
+    frame_to_message(buf, &msg);
+    mavlink_msg_command_long_decode(&msg, &cmd);
+    command_params(&cmd, params);
+    now = now_usec();
+
+    for (unsigned int i = 0; i < COALESCE_MAX_COMMANDS; i++) {
+        struct command *c = &_commands[i];
+
+        if (c->sent && now - c->sent >= STALE_USEC)
+            c->sent = 0;
+
+        if (!c->sent) {
+            if (!slot)
+                slot = c;
+            continue;
+        }
+
+        if (c->command != cmd.command || c->target_sysid != cmd.target_system
+            || c->target_compid != cmd.target_component
+            || memcmp(c->params, params, sizeof(params)) != 0)
+            continue;
+
+        _add_requester(c, from, msg.sysid, msg.compid);
+
+        if (now - c->sent < INFLIGHT_USEC) {
+            _suppressed_total++;
+            return true;
+        }
+
+        /* Retry: the vehicle may have missed it */
+        c->sent = now;
+        _forwarded_total++;
+        return false;
+    }
+
+    _forwarded_total++;
+
+    if (!slot) {
+        _untracked_total++;
+        return false;
+    }
+
+    slot->sent = now;
+    memcpy(slot->params, params, sizeof(params));
+    slot->command = cmd.command;
+    slot->target_sysid = cmd.target_system;
+    slot->target_compid = cmd.target_component;
+    slot->n_requesters = 0;
+    _add_requester(slot, from, msg.sysid, msg.compid);
+
+    return false;
+}
+
+/*
+ * Copy of @ack addressed to requester @r. It's made up on behalf of the
+ * vehicle, so it continues its sequence after the seq of @frame.
+ */
+void CommandCoalescer::_send_ack(const struct frame_info *frame, const struct buffer *ack,
+                                 const struct requester *r)
+{
+    const struct msg_meta *meta = msg_meta_get(MAVLINK_MSG_ID_COMMAND_ACK);
+    const struct mavlink_router_mavlink2_header *src =
+        (const struct mavlink_router_mavlink2_header *)ack->data;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct mavlink_router_mavlink2_header *hdr = (struct mavlink_router_mavlink2_header *)data;
+    uint8_t *payload = data + sizeof(*hdr);
+    unsigned int len = src->payload_len;
+    struct buffer buf;
+    uint16_t crc;
+
+    memcpy(data, ack->data, sizeof(*hdr) + len);
+
+    /* Put back what mavlink 2 truncated, up to the target fields */
+    if (len <= meta->target_component_ofs) {
+        memset(payload + len, 0, meta->target_component_ofs + 1 - len);
+        len = meta->target_component_ofs + 1;
+    }
+    payload[meta->target_system_ofs] = r->sysid;
+    payload[meta->target_component_ofs] = r->compid;
+    hdr->payload_len = len;
+
+    crc = crc_calculate(data + 1, sizeof(*hdr) + len - 1);
+    crc_accumulate(meta->crc_extra, &crc);
+    payload[len] = crc & 0xff;
+    payload[len + 1] = crc >> 8;
+
+    buf.data = data;
+    buf.len = sizeof(*hdr) + len + 2;
+
+    _mainloop.write_on_behalf(r->endpoint, &buf, frame->seq);
+    _acks_total++;
+}
+
+void CommandCoalescer::handle_from_vehicle(const struct frame_info *frame,
+                                           const struct buffer *buf)
+{
+    mavlink_command_ack_t ack;
+    mavlink_message_t msg;
+    struct command *match = nullptr;
+    int target_sysid = 0, target_compid = 0;
+
+    if (frame->msgid != MAVLINK_MSG_ID_COMMAND_ACK)
+        return;
+
+    frame_to_message(buf, &msg);
+    mavlink_msg_command_ack_decode(&msg, &ack);
+
+    /*
+     * Mavlink 1 can't address the ACK and a signed one can't be changed, so
+     * they are left as they are. So are ACKs if the target fields are not
+     * known to this build.
+     */
+    if (frame->version == 2 && !frame->is_signed && frame->target_compid >= 0) {
+        target_sysid = frame->target_sysid;
+        target_compid = frame->target_compid;
+    }
+
+    for (unsigned int i = 0; i < COALESCE_MAX_COMMANDS; i++) {
+        struct command *c = &_commands[i];
+
+        if (!c->sent || c->command != ack.command
+            || (c->target_sysid && c->target_sysid != msg.sysid)
+            || (c->target_compid && c->target_compid != msg.compid))
+            continue;
+
+        match = c;
+
+        /* Same command with other parameters: pick the one of the addressee */
+        for (unsigned int j = 0; j < c->n_requesters; j++) {
+            if (c->requesters[j].sysid == target_sysid && c->requesters[j].compid == target_compid)
+                goto found;
+        }
+    }
+
+    if (!match)
+        return;
+
+found:
+    /* Not addressed to anybody in particular, everybody takes it already */
+    if (target_sysid) {
+        for (unsigned int j = 0; j < match->n_requesters; j++) {
+            const struct requester *r = &match->requesters[j];
+
+            if (r->sysid != target_sysid || r->compid != target_compid)
+                _send_ack(frame, buf, r);
+        }
+    }
+
+    if (ack.result != MAV_RESULT_IN_PROGRESS)
+        match->sent = 0;
+}
+
+void CommandCoalescer::forget_endpoint(const Endpoint *e)
+{
+    for (unsigned int i = 0; i < COALESCE_MAX_COMMANDS; i++) {
+        struct command *c = &_commands[i];
+
+        for (unsigned int j = 0; j < c->n_requesters;) {
+            if (c->requesters[j].endpoint != e) {
+                j++;
+                continue;
+            }
+
+            c->n_requesters--;
+            memmove(&c->requesters[j], &c->requesters[j + 1],
+                    (c->n_requesters - j) * sizeof(c->requesters[0]));
+        }
+    }
+}
+
+void CommandCoalescer::print_statistics()
+{
+    printf("Command coalescing {"
+           "\n\tcommands forwarded: %u"
+           "\n\tradio frames saved: %u"
+           "\n\tACKs copied to requesters: %u"
+           "\n\tcommands not tracked: %u"
+           "\n\trequesters without ACK copy: %u"
+           "\n}"
+           "\n",
+           _forwarded_total, _suppressed_total, _acks_total, _untracked_total,
+           _requesters_dropped_total);
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include "comm.h"
+#include "util.h"
+
+class Mainloop;
+
+#define COALESCE_MAX_COMMANDS 16
+#define COALESCE_MAX_REQUESTERS 8
+
+/*
+ * Coalescing of COMMAND_LONGs going to the vehicle. When several GCSes and
+ * onboard apps send the same command, or retry it before the vehicle had a
+ * chance to answer, only the first copy crosses the radio: the others are
+ * suppressed while it's in flight, and the COMMAND_ACK the vehicle sends is
+ * copied to each of the requesters, addressed to them.
+ *
+ * Commands are the same if they go to the same target with the same
+ * parameters; the confirmation counter of retries is ignored. A command is
+ * in flight until its final ACK arrives or for a short while, so a retry of
+ * a command lost on the way still gets through.
+ */
+class CommandCoalescer {
+public:
+    CommandCoalescer(Mainloop &mainloop) : _mainloop(mainloop) { }
+
+    /*
+     * Look at packet from @from going to the vehicle. Returns true if it's
+     * a duplicate of a command in flight and must not be forwarded.
+     */
+    bool handle_to_vehicle(Endpoint *from, const struct frame_info *frame,
+                           const struct buffer *buf);
+
+    /* Snoop packet sent by the vehicle, after it was routed */
+    void handle_from_vehicle(const struct frame_info *frame, const struct buffer *buf);
+
+    /* Drop requesters behind @e, which is going away */
+    void forget_endpoint(const Endpoint *e);
+
+    void print_statistics();
+
+private:
+    struct requester {
+        Endpoint *endpoint;
+        uint8_t sysid;
+        uint8_t compid;
+    };
+
+    struct command {
+        /* when it was forwarded, 0 if the entry is free */
+        usec_t sent;
+        float params[7];
+        uint16_t command;
+        uint8_t target_sysid;
+        uint8_t target_compid;
+        struct requester requesters[COALESCE_MAX_REQUESTERS];
+        unsigned int n_requesters;
+    };
+
+    void _send_ack(const struct frame_info *frame, const struct buffer *ack,
+                   const struct requester *r);
+    void _add_requester(struct command *c, Endpoint *endpoint, uint8_t sysid, uint8_t compid);
+
+    Mainloop &_mainloop;
+
+    struct command _commands[COALESCE_MAX_COMMANDS] = { };
+
+    uint32_t _forwarded_total = 0;
+    uint32_t _suppressed_total = 0;
+    uint32_t _acks_total = 0;
+    uint32_t _untracked_total = 0;
+    uint32_t _requesters_dropped_total = 0;
+};
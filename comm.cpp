@@ -21,6 +21,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/filter.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,52 +32,27 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <mavlink.h>
 
+#include "conflate.h"
+#include "frame.h"
 #include "log.h"
+#include "msgmeta.h"
 #include "util.h"
 
-#define RX_BUF_MAX_SIZE (MAVLINK_MAX_PACKET_LEN * 4)
+/* Can be set at build time, see configure --with-tx-buf-size */
+#ifndef TX_BUF_MAX_SIZE
 #define TX_BUF_MAX_SIZE (8U * 1024U)
+#endif
+/* Big enough for a datagram of frames batched by another router */
+#define RX_BUF_MAX_SIZE (TX_BUF_MAX_SIZE + MAVLINK_MAX_PACKET_LEN * 4)
 
-/*
- * mavlink 2.0 packet in its wire format
- *
- * Packet size:
- *      sizeof(mavlink_router_mavlink2_header)
- *      + payload length
- *      + 2 (checksum)
- *      + signature (0 if not signed)
- */
-struct _packed_ mavlink_router_mavlink2_header {
-    uint8_t magic;
-    uint8_t payload_len;
-    uint8_t incompat_flags;
-    uint8_t compat_flags;
-    uint8_t seq;
-    uint8_t sysid;
-    uint8_t compid;
-    uint32_t msgid : 24;
-};
-
-/*
- * mavlink 1.0 packet in its wire format
- *
- * Packet size:
- *      sizeof(mavlink_router_mavlink1_header)
- *      + payload length
- *      + 2 (checksum)
- */
-struct _packed_ mavlink_router_mavlink1_header {
-    uint8_t magic;
-    uint8_t payload_len;
-    uint8_t seq;
-    uint8_t sysid;
-    uint8_t compid;
-    uint8_t msgid;
-};
+/* Sources tracked per endpoint, power of 2 */
+#define SEQ_STATS_SIZE 32U
 
 Endpoint::Endpoint(const char *name, bool crc_check_enabled)
     : _name{name}
@@ -93,64 +72,139 @@ Endpoint::~Endpoint()
     if (fd >= 0) {
         ::close(fd);
     }
+
+    free(_dwell);
+    free(_seq_stats);
 }
 
-int Endpoint::read_msg(struct buffer *pbuf)
+size_t Endpoint::footprint(unsigned int n_peers)
 {
-    bool should_read_more = true;
+    /* 1 KiB for the largest endpoint object */
+    return RX_BUF_MAX_SIZE + TX_BUF_MAX_SIZE + 1024
+        + SEQ_STATS_SIZE * sizeof(struct seq_stats)
+        + n_peers * sizeof(struct dwell_stats);
+}
 
-    if (fd < 0) {
-        log_error("Trying to read invalid fd");
-        return -EINVAL;
+void Endpoint::preallocate(unsigned int n_peers)
+{
+    if (!_seq_stats) {
+        _seq_stats = (struct seq_stats *) calloc(SEQ_STATS_SIZE, sizeof(*_seq_stats));
+        assert(_seq_stats);
+    }
+
+    if (_dwell_capacity < n_peers) {
+        _dwell = (struct dwell_stats *) realloc(_dwell, n_peers * sizeof(*_dwell));
+        assert(_dwell);
+        _dwell_capacity = n_peers;
+    }
+}
+
+void Endpoint::_consume(size_t len)
+{
+    _rx_pos += len;
+    if (_rx_pos == rx_buf.len)
+        _rx_pos = rx_buf.len = 0;
+
+    _resync_window = _resync_window > len ? _resync_window - len : 0;
+}
+
+/*
+ * The packet at _rx_pos failed the checks: it may have been a
+ * start byte appearing in noise, with good packets hidden in the bytes it
+ * claimed. Rather than skipping all of them, restart from the next start
+ * byte after it.
+ */
+void Endpoint::_resync(size_t claimed_len)
+{
+    const uint8_t *data = rx_buf.data + _rx_pos;
+    size_t len = rx_buf.len - _rx_pos;
+    size_t i;
+
+    for (i = 1; i < len; i++) {
+        if (data[i] == MAVLINK_STX || data[i] == MAVLINK_STX_MAVLINK1)
+            break;
     }
 
+    _resync_total++;
+    if (claimed_len > _resync_window)
+        _resync_window = claimed_len;
+
+    _consume(i);
+}
+
+int Endpoint::read_msg(struct buffer *pbuf, struct frame_info *frame)
+{
+    bool should_read_more = true;
+    int r;
+
     if (_last_packet_len != 0) {
         /*
          * read_msg() should be called in a loop after writting to each
          * output. However we don't want to keep busy looping on a single
-         * endpoint reading more data. If we left data behind, move them
-         * to the beginning and check we have a complete packet, but don't
-         * read more data right now - it will be handled on next
-         * iteration when more data is available
+         * endpoint reading more data. If we left data behind, check we
+         * have a complete packet, but don't read more data right now - it
+         * will be handled on next iteration when more data is available
          */
         should_read_more = false;
 
-        /* see TODO below about using bigger buffers: we could just walk on
-         * the buffer rather than moving bytes */
-        rx_buf.len -= _last_packet_len;
-        if (rx_buf.len > 0) {
-            memmove(rx_buf.data, rx_buf.data + _last_packet_len, rx_buf.len);
-        }
-
+        _consume(_last_packet_len);
         _last_packet_len = 0;
     }
 
     if (should_read_more) {
-        ssize_t r = _read_msg(rx_buf.data + rx_buf.len, RX_BUF_MAX_SIZE - rx_buf.len);
-        if (r <= 0)
-            return r;
+        /* Move what is left to the beginning, once per read */
+        if (_rx_pos > 0) {
+            rx_buf.len -= _rx_pos;
+            memmove(rx_buf.data, rx_buf.data + _rx_pos, rx_buf.len);
+            _rx_pos = 0;
+        }
 
-        log_debug("%s: Got %zd bytes", _name, r);
-        rx_buf.len += r;
+        ssize_t n = _read_msg(rx_buf.data + rx_buf.len, RX_BUF_MAX_SIZE - rx_buf.len);
+        if (n <= 0)
+            return n;
+
+        log_debug("%s: Got %zd bytes", _name, n);
+        rx_buf.len += n;
     }
 
-    bool mavlink2 = rx_buf.data[0] == MAVLINK_STX;
-    bool mavlink1 = rx_buf.data[0] == MAVLINK_STX_MAVLINK1;
+    /*
+     * After a bad packet, look for the next one in what is left right away:
+     * there may be complete packets behind it and no more data coming to
+     * get us called again. Each try consumes at least one byte.
+     */
+    do {
+        r = _parse_msg(pbuf, frame);
+    } while (r == -EBADMSG);
+
+    return r;
+}
+
+int Endpoint::_parse_msg(struct buffer *pbuf, struct frame_info *frame)
+{
+    /* the bytes not parsed yet start at _rx_pos */
+    uint8_t *data = rx_buf.data + _rx_pos;
+    size_t len = rx_buf.len - _rx_pos;
+
+    if (len == 0)
+        return 0;
+
+    bool mavlink2 = data[0] == MAVLINK_STX;
+    bool mavlink1 = data[0] == MAVLINK_STX_MAVLINK1;
 
     /*
      * Find magic byte as the start byte:
      *
      * we either enter here due to new bytes being written to the
-     * beginning of the buffer or due to _last_packet_len not being 0
-     * above, which means we moved some bytes we read previously
+     * buffer or due to _last_packet_len not being 0 above, which means
+     * we skipped the packet we returned previously
      */
     if (!mavlink1 && !mavlink2) {
         unsigned int stx_pos = 0;
 
-        for (unsigned int i = 1; i < (unsigned int) rx_buf.len; i++) {
-            if (rx_buf.data[i] == MAVLINK_STX)
+        for (unsigned int i = 1; i < (unsigned int) len; i++) {
+            if (data[i] == MAVLINK_STX)
                 mavlink2 = true;
-            else if (rx_buf.data[i] == MAVLINK_STX_MAVLINK1)
+            else if (data[i] == MAVLINK_STX_MAVLINK1)
                 mavlink1 = true;
 
             if (mavlink1 || mavlink2) {
@@ -161,90 +215,100 @@ int Endpoint::read_msg(struct buffer *pbuf)
 
         /* Discarding data since we don't have a marker */
         if (stx_pos == 0) {
-            rx_buf.len = 0;
+            _consume(len);
             return 0;
         }
 
-        /*
-         * TODO: a larger buffer would allow to avoid the memmove in case a
-         * new message would still fit in our buffer
-         */
-        rx_buf.len -= stx_pos;
-        memmove(rx_buf.data, rx_buf.data + stx_pos, rx_buf.len);
+        _consume(stx_pos);
+        data += stx_pos;
+        len -= stx_pos;
     }
 
-    const uint8_t checksum_len = 2;
+    const struct msg_meta *meta;
     size_t expected_size;
 
-    if (mavlink2) {
-        struct mavlink_router_mavlink2_header *hdr =
-                (struct mavlink_router_mavlink2_header *)rx_buf.data;
-
-        if (rx_buf.len < sizeof(*hdr))
-            return 0;
-
-        expected_size = sizeof(*hdr);
-        expected_size += hdr->payload_len;
-        expected_size += checksum_len;
-        if (hdr->incompat_flags & MAVLINK_IFLAG_SIGNED)
-            expected_size += MAVLINK_SIGNATURE_BLOCK_LEN;
-    } else {
-        struct mavlink_router_mavlink1_header *hdr =
-                (struct mavlink_router_mavlink1_header *)rx_buf.data;
+    if (len < (mavlink2 ? sizeof(struct mavlink_router_mavlink2_header)
+                        : sizeof(struct mavlink_router_mavlink1_header)))
+        return 0;
 
-        if (rx_buf.len < sizeof(*hdr))
-            return 0;
+    /* The only time the header is decoded, everybody else gets frame */
+    frame_parse_header(data, frame);
+    expected_size = frame->len;
+    meta = msg_meta_get(frame->msgid);
 
-        expected_size = sizeof(*hdr);
-        expected_size += hdr->payload_len;
-        expected_size += checksum_len;
+    /* Don't wait for the bytes of a packet that can't be valid */
+    if (_crc_check_enabled && !_check_len(frame, meta)) {
+        _resync(expected_size);
+        return -EBADMSG;
     }
 
     /* check if we have a valid mavlink packet */
-    if (rx_buf.len < expected_size)
+    if (len < expected_size)
         return 0;
 
+    _read_total++;
+
+    frame_parse_payload(data, meta, frame);
+
+    if (_crc_check_enabled && !_check_crc(frame, meta)) {
+        _resync(expected_size);
+        return -EBADMSG;
+    }
+
     /* We always want to transmit one packet at a time; record the number
      * of bytes read in addition to the expected size and leave them for
      * the next iteration */
     _last_packet_len = expected_size;
-    _read_total++;
 
-    if (_crc_check_enabled && !_check_crc())
-        return 0;
+    /* without resync this packet would have been skipped with a bad one */
+    if (_resync_window > 0)
+        _recovered_total++;
+
+    _account_seq(frame->sysid, frame->compid, frame->seq);
+
+    if (_liveness_timeout) {
+        _last_rx_usec = now_usec();
+        if (_parked) {
+            _parked = false;
+            _reactivated_total++;
+            log_info("%s %u: peer is back, resuming", _name, id);
+        }
+    }
 
-    pbuf->data = rx_buf.data;
+    frame->ingress = id;
+    frame->rx_timestamp = _rx_timestamp;
+
+    pbuf->data = data;
     pbuf->len = expected_size;
 
     return 1;
 }
 
-bool Endpoint::_check_crc()
+bool Endpoint::_check_len(const struct frame_info *frame, const struct msg_meta *meta)
 {
-    const bool mavlink2 = rx_buf.data[0] == MAVLINK_STX;
-    uint32_t msg_id;
-    uint16_t crc_msg, crc_calc;
-    uint8_t payload_len, header_len, *payload;
-    const mavlink_msg_entry_t *msg_entry;
+    /* Unknown messages are forwarded, see _check_crc() */
+    if (!meta)
+        return true;
 
-    if (mavlink2) {
-        struct mavlink_router_mavlink2_header *hdr =
-                    (struct mavlink_router_mavlink2_header *)rx_buf.data;
-        payload = rx_buf.data + sizeof(*hdr);
-        msg_id = hdr->msgid;
-        header_len = sizeof(*hdr);
-        payload_len = hdr->payload_len;
-    } else {
-        struct mavlink_router_mavlink1_header *hdr =
-                    (struct mavlink_router_mavlink1_header *)rx_buf.data;
-        payload = rx_buf.data + sizeof(*hdr);
-        msg_id = hdr->msgid;
-        header_len = sizeof(*hdr);
-        payload_len = hdr->payload_len;
+    /*
+     * Mavlink 2 may truncate zeros at the end of payload, but can't be
+     * longer than the message with all extensions. Mavlink 1 has no
+     * truncation, but might carry extensions from a mavlink 2 sender.
+     */
+    if (frame->payload_len > meta->max_len
+        || (frame->version == 1 && frame->payload_len < meta->min_len)) {
+        _read_len_errors++;
+        return false;
     }
 
-    msg_entry = mavlink_get_msg_entry(msg_id);
-    if (!msg_entry) {
+    return true;
+}
+
+bool Endpoint::_check_crc(const struct frame_info *frame, const struct msg_meta *meta)
+{
+    uint16_t crc_calc;
+
+    if (!meta) {
         /*
          * It is accepting and forwarding unknown messages ids because
          * it can be a new MAVLink message implemented only in
@@ -254,10 +318,10 @@ bool Endpoint::_check_crc()
         return true;
     }
 
-    crc_msg = payload[payload_len] | (payload[payload_len + 1] << 8);
-    crc_calc = crc_calculate(&rx_buf.data[1], header_len + payload_len - 1);
-    crc_accumulate(msg_entry->crc_extra, &crc_calc);
-    if (crc_calc != crc_msg) {
+    crc_calc = crc_calculate(&rx_buf.data[_rx_pos + 1],
+                             frame_header_len(frame) + frame->payload_len - 1);
+    crc_accumulate(meta->crc_extra, &crc_calc);
+    if (crc_calc != frame->crc) {
         _read_crc_errors++;
         return false;
     }
@@ -265,18 +329,287 @@ bool Endpoint::_check_crc()
     return true;
 }
 
+void Endpoint::_account_seq(uint8_t sysid, uint8_t compid, uint8_t seq)
+{
+    unsigned int key = (sysid << 8) | compid;
+    unsigned int i = (key * 2654435761U) >> 27;
+    struct seq_stats *st = nullptr;
+
+    if (!_seq_stats) {
+        _seq_stats = (struct seq_stats *) calloc(SEQ_STATS_SIZE, sizeof(*_seq_stats));
+        if (!_seq_stats)
+            return;
+    }
+
+    /* linear probing, never removed */
+    for (unsigned int n = 0; n < SEQ_STATS_SIZE; n++, i = (i + 1) & (SEQ_STATS_SIZE - 1)) {
+        st = &_seq_stats[i];
+        if (!st->used || (st->sysid == sysid && st->compid == compid))
+            break;
+        st = nullptr;
+    }
+
+    if (!st) {
+        _seq_untracked++;
+        return;
+    }
+
+    if (!st->used) {
+        st->used = true;
+        st->sysid = sysid;
+        st->compid = compid;
+        st->last_seq = seq;
+        st->received = 1;
+        st->last_arrival = _rx_timestamp;
+        return;
+    }
+
+    st->received++;
+
+    uint8_t diff = seq - st->last_seq;
+    if (diff > 0 && diff < 128) {
+        st->lost += diff - 1;
+        st->last_seq = seq;
+        st->missing = diff < 64 ? st->missing << diff : 0;
+        st->missing |= diff - 1 < 64 ? (1ULL << (diff - 1)) - 1 : UINT64_MAX;
+    } else {
+        /* Older than the last one: only late if it was counted as lost */
+        unsigned int behind = (uint8_t)(st->last_seq - seq) - 1;
+
+        if (diff != 0 && behind < 64 && st->missing & (1ULL << behind)) {
+            st->missing &= ~(1ULL << behind);
+            st->reordered++;
+            st->lost--;
+        } else {
+            st->duplicates++;
+        }
+    }
+
+    if (_rx_timestamp && st->last_arrival && _rx_timestamp >= st->last_arrival) {
+        nsec_t interval = _rx_timestamp - st->last_arrival;
+        nsec_t d = interval > st->last_interval ? interval - st->last_interval
+                                                : st->last_interval - interval;
+
+        if (d > UINT32_MAX)
+            d = UINT32_MAX;
+        st->jitter += ((int64_t) d - (int64_t) st->jitter) / 16;
+        st->last_interval = interval;
+    }
+    st->last_arrival = _rx_timestamp;
+}
+
+void Endpoint::record_dwell(const Endpoint *from, nsec_t dwell)
+{
+    struct dwell_stats *d = _dwell;
+    struct dwell_stats *end = _dwell + _n_dwell;
+
+    /* Few ingresses per endpoint: only the master talks to all of them */
+    for (; d < end; d++) {
+        if (d->from == from)
+            break;
+    }
+
+    if (d == end) {
+        if (_n_dwell == _dwell_capacity) {
+            d = (struct dwell_stats *) realloc(_dwell, (_n_dwell + 1) * sizeof(*_dwell));
+            if (!d)
+                return;
+            _dwell = d;
+            _dwell_capacity++;
+        }
+        d = &_dwell[_n_dwell++];
+        memset(d, 0, sizeof(*d));
+        d->from = from;
+    }
+
+    histogram_record(&d->hist, dwell);
+}
+
+void Endpoint::forget_peer(const Endpoint *peer)
+{
+    for (unsigned int i = 0; i < _n_dwell; i++) {
+        if (_dwell[i].from == peer) {
+            _dwell[i] = _dwell[--_n_dwell];
+            return;
+        }
+    }
+}
+
+int Endpoint::take_seq(uint8_t sysid, uint8_t compid, uint8_t last_seq)
+{
+    struct seq_shift *s = _seq_shifts;
+    struct seq_shift *end = _seq_shifts + _n_seq_shifts;
+
+    for (; s < end; s++) {
+        if (s->sysid == sysid && s->compid == compid)
+            break;
+    }
+
+    if (s == end) {
+        if (_n_seq_shifts == ENDPOINT_MAX_SEQ_SHIFTS)
+            return -ENOSPC;
+        s = &_seq_shifts[_n_seq_shifts++];
+        s->sysid = sysid;
+        s->compid = compid;
+        s->shift = 0;
+    }
+
+    s->shift++;
+    s->last_seq = last_seq;
+
+    return (uint8_t)(last_seq + s->shift);
+}
+
+bool Endpoint::renumber(const struct buffer *buf, const struct frame_info *frame,
+                        struct buffer *out, struct frame_info *out_frame)
+{
+    const struct msg_meta *meta;
+
+    for (unsigned int i = 0; i < _n_seq_shifts; i++) {
+        struct seq_shift *s = &_seq_shifts[i];
+        uint8_t lost;
+
+        if (s->sysid != frame->sysid || s->compid != frame->compid)
+            continue;
+
+        /*
+         * The peer counts the packets lost before the router as received
+         * instead of the ones made up, until there are as many. Anything
+         * too far behind is a duplicate or out of order, not a loss.
+         */
+        lost = frame->seq - s->last_seq - 1;
+        if (lost < 128) {
+            s->shift -= lost < s->shift ? lost : s->shift;
+            s->last_seq = frame->seq;
+        }
+
+        /* Back in step: forward packets as they are again */
+        if (!s->shift) {
+            *s = _seq_shifts[--_n_seq_shifts];
+            return false;
+        }
+
+        /* A signed packet can't be changed: the peer sees a gap instead */
+        meta = msg_meta_get(frame->msgid);
+        if (frame->is_signed || !meta)
+            return false;
+
+        memcpy(out->data, buf->data, buf->len);
+        out->len = buf->len;
+        *out_frame = *frame;
+        frame_set_seq(out->data, out_frame, meta, frame->seq + s->shift);
+
+        return true;
+    }
+
+    return false;
+}
+
+void Endpoint::set_liveness(usec_t timeout, usec_t probe_interval)
+{
+    _liveness_timeout = timeout;
+    _probe_interval = probe_interval;
+    _last_rx_usec = now_usec();
+    _parked = false;
+}
+
+void Endpoint::park(usec_t now)
+{
+    if (_parked)
+        return;
+
+    _parked = true;
+    _parked_total++;
+    _next_probe_usec = now + _probe_interval;
+    log_info("%s %u: no reply from peer, parking", _name, id);
+}
+
+bool Endpoint::liveness_check(usec_t now)
+{
+    if (!_parked) {
+        if (now - _last_rx_usec < _liveness_timeout)
+            return true;
+        park(now);
+    }
+
+    if (now >= _next_probe_usec) {
+        _next_probe_usec = now + _probe_interval;
+        return true;
+    }
+
+    _suppressed_total++;
+    return false;
+}
+
 void Endpoint::print_statistics()
 {
     printf("Endpoint {"
            "\n\tname: %s" \
+           "\n\tid: %u" \
            "\n\tmessages read: %u" \
            "\n\tmessages read with CRC error: %u %f%%" \
+           "\n\tmessages read with invalid length: %u" \
+           "\n\tresyncs after bad packets: %u" \
+           "\n\tmessages recovered by resync: %u" \
            "\n\tmessages written: %u" \
            "\n}" \
            "\n",
-           _name, _read_total, _read_crc_errors,
+           _name, id, _read_total, _read_crc_errors,
            (_read_crc_errors * 100.0f) / (_read_total == 0 ? 1 : _read_total),
-           _write_total);
+           _read_len_errors, _resync_total, _recovered_total, _write_total);
+
+    if (_liveness_timeout) {
+        printf("Liveness {" \
+               "\n\tstate: %s" \
+               "\n\ttimes parked: %u" \
+               "\n\ttimes reactivated: %u" \
+               "\n\tmessages suppressed: %u" \
+               "\n}" \
+               "\n",
+               _parked ? "parked" : "active",
+               _parked_total, _reactivated_total, _suppressed_total);
+    }
+
+    for (unsigned int i = 0; _seq_stats && i < SEQ_STATS_SIZE; i++) {
+        const struct seq_stats *st = &_seq_stats[i];
+
+        if (!st->used)
+            continue;
+
+        printf("Link quality from %u/%u {" \
+               "\n\tmessages received: %u" \
+               "\n\tmessages lost: %u" \
+               "\n\tduplicates: %u" \
+               "\n\treordered: %u" \
+               "\n\tlink quality: %.1f%%" \
+               "\n\tjitter (us): %.1f" \
+               "\n}" \
+               "\n",
+               st->sysid, st->compid, st->received, st->lost, st->duplicates,
+               st->reordered, st->received * 100.0 / (st->received + st->lost),
+               st->jitter / (double) NSEC_PER_USEC);
+    }
+
+    if (_seq_untracked)
+        printf("Link quality: %u messages from untracked sources\n", _seq_untracked);
+
+    for (unsigned int i = 0; i < _n_dwell; i++) {
+        const struct histogram *h = &_dwell[i].hist;
+
+        printf("Dwell time from %s %u to %s %u (us) {" \
+               "\n\tmessages: %" PRIu64 \
+               "\n\tp50: %.1f" \
+               "\n\tp99: %.1f" \
+               "\n\tp99.9: %.1f" \
+               "\n\tmax: %.1f" \
+               "\n}" \
+               "\n",
+               _dwell[i].from->_name, _dwell[i].from->id, _name, id, h->count,
+               histogram_percentile(h, 50) / (double) NSEC_PER_USEC,
+               histogram_percentile(h, 99) / (double) NSEC_PER_USEC,
+               histogram_percentile(h, 99.9) / (double) NSEC_PER_USEC,
+               h->max / (double) NSEC_PER_USEC);
+    }
 }
 
 int UartEndpoint::open(const char *path, speed_t baudrate)
@@ -333,10 +666,13 @@ ssize_t UartEndpoint::_read_msg(uint8_t *buf, size_t len)
     if (r == -1)
         return -errno;
 
+    /* Packets are only complete after the read that got their last byte */
+    _rx_timestamp = now_realtime_nsec();
+
     return r;
 }
 
-int UartEndpoint::write_msg(const struct buffer *pbuf)
+int UartEndpoint::write_msg(const struct buffer *pbuf, const struct frame_info *frame)
 {
     if (fd < 0) {
         log_error("Trying to write invalid fd");
@@ -371,30 +707,160 @@ UdpEndpoint::UdpEndpoint()
     bzero(&sockaddr, sizeof(sockaddr));
 }
 
-int UdpEndpoint::open(const char *ip, unsigned long port)
+UdpEndpoint::~UdpEndpoint()
+{
+    delete _queue;
+}
+
+void UdpEndpoint::enable_conflation()
+{
+    if (!_queue)
+        _queue = new ConflatingQueue{};
+}
+
+int UdpEndpoint::_parse_address(const char *ip, unsigned long port)
+{
+    bzero(&sockaddr, sizeof(sockaddr));
+
+    if (strchr(ip, ':')) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sockaddr;
+        char addr[INET6_ADDRSTRLEN];
+        const char *scope = strchr(ip, '%');
+        size_t addrlen = scope ? (size_t)(scope - ip) : strlen(ip);
+
+        if (addrlen >= sizeof(addr))
+            return -EINVAL;
+
+        memcpy(addr, ip, addrlen);
+        addr[addrlen] = '\0';
+        if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1)
+            return -EINVAL;
+
+        /* link-local and multicast addresses may need an interface: addr%iface */
+        if (scope) {
+            sin6->sin6_scope_id = if_nametoindex(scope + 1);
+            if (sin6->sin6_scope_id == 0)
+                return -EINVAL;
+        }
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sockaddr_len = sizeof(*sin6);
+        _multicast = IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&sockaddr;
+
+        if (inet_pton(AF_INET, ip, &sin->sin_addr) != 1)
+            return -EINVAL;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sockaddr_len = sizeof(*sin);
+        _multicast = IN_MULTICAST(ntohl(sin->sin_addr.s_addr));
+    }
+
+    return 0;
+}
+
+int UdpEndpoint::_setup_multicast(int ttl, bool loop)
+{
+    const int loop_val = loop;
+
+    if (sockaddr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&sockaddr;
+        const unsigned int ifindex = sin6->sin6_scope_id;
+
+        if (ifindex && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex))) {
+            log_error_errno(errno, "Error setting multicast interface (%m)");
+            return -1;
+        }
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl))) {
+            log_error_errno(errno, "Error setting multicast hops (%m)");
+            return -1;
+        }
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop_val, sizeof(loop_val))) {
+            log_error_errno(errno, "Error setting multicast loopback (%m)");
+            return -1;
+        }
+    } else {
+        if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))) {
+            log_error_errno(errno, "Error setting multicast TTL (%m)");
+            return -1;
+        }
+        if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop_val, sizeof(loop_val))) {
+            log_error_errno(errno, "Error setting multicast loopback (%m)");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Have the kernel tell us when each datagram arrived so we can account the
+ * time it waited in the socket as part of its time in the router
+ */
+int UdpEndpoint::_enable_timestamps()
+{
+    const int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one))) {
+        log_error_errno(errno, "Error enabling timestamps in socket (%m)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int UdpEndpoint::set_busy_poll(unsigned int usec)
+{
+    /* Going above net.core.busy_read needs CAP_NET_ADMIN */
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec))) {
+        log_error_errno(errno, "Error enabling busy poll in socket (%m)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int UdpEndpoint::open(const char *ip, unsigned long port, int mcast_ttl, bool mcast_loop)
 {
     const int broadcast_val = 1;
-    fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (_parse_address(ip, port) < 0) {
+        log_error("Invalid IP address: %s", ip);
+        return -1;
+    }
+
+    fd = socket(sockaddr.ss_family, SOCK_DGRAM, 0);
     if (fd == -1) {
         log_error_errno(errno, "Could not create socket (%m)");
         return -1;
     }
 
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_addr.s_addr = inet_addr(ip);
-    sockaddr.sin_port = htons(port);
+    if (_multicast) {
+        if (_setup_multicast(mcast_ttl, mcast_loop) < 0)
+            goto fail;
+    } else if (sockaddr.ss_family == AF_INET) {
+        /* there's no broadcast in IPv6, only multicast */
+        if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &broadcast_val, sizeof(broadcast_val))) {
+            log_error_errno(errno, "Error enabling broadcast in socket (%m)");
+            goto fail;
+        }
+    }
 
-    if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &broadcast_val, sizeof(broadcast_val))) {
-        log_error_errno(errno, "Error enabling broadcast in socket (%m)");
+    if (_enable_timestamps() < 0)
         goto fail;
-    }
 
     if (fcntl(fd, F_SETFL, O_NONBLOCK | FASYNC) < 0) {
         log_error_errno(errno, "Error setting socket fd as non-blocking (%m)");
         goto fail;
     }
 
-    log_info("Open %s:%lu", ip, port);
+    if (sockaddr.ss_family == AF_INET6)
+        log_info("Open [%s]:%lu%s", ip, port, _multicast ? " (multicast)" : "");
+    else
+        log_info("Open %s:%lu%s", ip, port, _multicast ? " (multicast)" : "");
 
     return fd;
 
@@ -406,48 +872,736 @@ fail:
     return -1;
 }
 
-ssize_t UdpEndpoint::_read_msg(uint8_t *buf, size_t len)
+int UdpEndpoint::_join_multicast()
 {
-    socklen_t addrlen = sizeof(sockaddr);
-    ssize_t r = ::recvfrom(fd, buf, len, 0,
-                           (struct sockaddr *)&sockaddr, &addrlen);
-    if (r == -1 && errno == EAGAIN)
-        return 0;
-    if (r == -1)
-        return -errno;
+    if (sockaddr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&sockaddr;
+        struct ipv6_mreq mreq = { };
+
+        mreq.ipv6mr_multiaddr = sin6->sin6_addr;
+        mreq.ipv6mr_interface = sin6->sin6_scope_id;
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq))) {
+            log_error_errno(errno, "Error joining multicast group (%m)");
+            return -1;
+        }
+    } else {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&sockaddr;
+        struct ip_mreq mreq = { };
+
+        mreq.imr_multiaddr = sin->sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+            log_error_errno(errno, "Error joining multicast group (%m)");
+            return -1;
+        }
+    }
 
-    return r;
+    return 0;
 }
 
-int UdpEndpoint::write_msg(const struct buffer *pbuf)
+/*
+ * Classic BPF program for the SO_REUSEPORT group: it returns the index of the
+ * socket that should receive the datagram, i.e. the sysid of the first frame
+ * in it modulo the number of sockets. This keeps all the traffic from one
+ * vehicle on the same shard so it's still delivered in order. Anything that
+ * doesn't look like MAVLink goes to shard 0.
+ */
+int UdpEndpoint::_attach_sysid_steering(unsigned int n_shards)
 {
-    if (fd < 0) {
-        log_error("Trying to write invalid fd");
-        return -EINVAL;
-    }
+    struct sock_filter code[] = {
+        /* A = magic */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, MAVLINK_STX, 0, 2),
+        /* mavlink 2: A = sysid */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct mavlink_router_mavlink2_header, sysid)),
+        BPF_JUMP(BPF_JMP | BPF_JA, 2, 0, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, MAVLINK_STX_MAVLINK1, 0, 3),
+        /* mavlink 1: A = sysid */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct mavlink_router_mavlink1_header, sysid)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n_shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { };
 
-    /* TODO: send any pending data */
-    if (tx_buf.len > 0) {
-        ;
+    prog.len = ARRAY_SIZE(code);
+    prog.filter = code;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+        log_error_errno(errno, "Error attaching steering program to socket (%m)");
+        return -1;
     }
 
-    ssize_t r = ::sendto(fd, pbuf->data, pbuf->len, 0,
-                         (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    if (r == -1) {
-        if (errno != EAGAIN && errno != ECONNREFUSED)
-            log_error_errno(errno, "Error sending udp packet (%m)");
-        return -errno;
-    };
+    return 0;
+}
 
-    _write_total++;
+int UdpEndpoint::open_ingress(const char *ip, unsigned long port,
+                              unsigned int shard, unsigned int n_shards)
+{
+    const int one = 1;
 
-    /* Incomplete packet, we warn and discard the rest */
-    if (r != (ssize_t) pbuf->len) {
-        log_warning("Discarding packet, incomplete write %zd but len=%u",
-                    r, pbuf->len);
+    assert(n_shards > 0);
+    assert(shard < n_shards);
+
+    if (_parse_address(ip, port) < 0) {
+        log_error("Invalid IP address: %s", ip);
+        return -1;
     }
 
-    log_debug("UDP: wrote %zd bytes", r);
+    fd = socket(sockaddr.ss_family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        log_error_errno(errno, "Could not create socket (%m)");
+        return -1;
+    }
 
-    return r;
+    if (n_shards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        log_error_errno(errno, "Error enabling port reuse in socket (%m)");
+        goto fail;
+    }
+
+    if (_multicast && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+        log_error_errno(errno, "Error enabling address reuse in socket (%m)");
+        goto fail;
+    }
+
+    if (bind(fd, (struct sockaddr *)&sockaddr, sockaddr_len) < 0) {
+        log_error_errno(errno, "Error binding socket (%m)");
+        goto fail;
+    }
+
+    if (_multicast && _join_multicast() < 0)
+        goto fail;
+
+    /* The program applies to the whole group, attach it once all shards are in */
+    if (n_shards > 1 && shard == n_shards - 1 && _attach_sysid_steering(n_shards) < 0)
+        goto fail;
+
+    if (_enable_timestamps() < 0)
+        goto fail;
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK | FASYNC) < 0) {
+        log_error_errno(errno, "Error setting socket fd as non-blocking (%m)");
+        goto fail;
+    }
+
+    /* Nobody to talk to until the first datagram arrives */
+    _multicast = false;
+    sockaddr_len = 0;
+
+    if (sockaddr.ss_family == AF_INET6)
+        log_info("Listen on [%s]:%lu (shard %u/%u)", ip, port, shard + 1, n_shards);
+    else
+        log_info("Listen on %s:%lu (shard %u/%u)", ip, port, shard + 1, n_shards);
+
+    return fd;
+
+fail:
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    return -1;
+}
+
+ssize_t UdpEndpoint::_read_msg(uint8_t *buf, size_t len)
+{
+    struct sockaddr_storage src;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { };
+    struct cmsghdr *cmsg;
+
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t r = ::recvmsg(fd, &msg, 0);
+    if (r == -1 && errno == EAGAIN)
+        return 0;
+    if (r == -1)
+        return -errno;
+
+    _rx_timestamp = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            _rx_timestamp = ts_nsec(&ts);
+        }
+    }
+    if (!_rx_timestamp)
+        _rx_timestamp = now_realtime_nsec();
+
+    /* unicast endpoints talk back to whoever talked to us last */
+    if (!_multicast) {
+        memcpy(&sockaddr, &src, msg.msg_namelen);
+        sockaddr_len = msg.msg_namelen;
+    }
+
+    return r;
+}
+
+ssize_t UdpEndpoint::_send(const uint8_t *data, size_t len)
+{
+    ssize_t r = ::sendto(fd, data, len, 0, (struct sockaddr *)&sockaddr, sockaddr_len);
+    if (r == -1) {
+        if (errno != EAGAIN && errno != ECONNREFUSED)
+            log_error_errno(errno, "Error sending udp packet (%m)");
+        return -errno;
+    };
+
+    /* Incomplete packet, we warn and discard the rest */
+    if (r != (ssize_t) len) {
+        log_warning("Discarding packet, incomplete write %zd but len=%zu",
+                    r, len);
+    }
+
+    log_debug("UDP: wrote %zd bytes", r);
+
+    return r;
+}
+
+int UdpEndpoint::write_msg(const struct buffer *pbuf, const struct frame_info *frame)
+{
+    if (fd < 0) {
+        log_error("Trying to write invalid fd");
+        return -EINVAL;
+    }
+
+    /* Ingress endpoint that didn't hear from anybody yet */
+    if (sockaddr_len == 0)
+        return 0;
+
+    /* Keep order with what's already queued */
+    if (_queue && !_queue->empty()) {
+        _queue->push(pbuf, frame);
+        return -EAGAIN;
+    }
+
+    if (_batch_max_size && pbuf->len <= _batch_max_size) {
+        if (tx_buf.len + pbuf->len > _batch_max_size) {
+            int r = flush_pending_msgs();
+            /* Still full: drop it as we would do without batching */
+            if (r == -EAGAIN)
+                return r;
+        }
+
+        if (tx_buf.len == 0)
+            _flush_deadline = now_usec() + _batch_delay;
+
+        memcpy(tx_buf.data + tx_buf.len, pbuf->data, pbuf->len);
+        tx_buf.len += pbuf->len;
+        _batch_msgs++;
+        _write_total++;
+
+        /* Not even the smallest frame fits anymore */
+        if (_batch_max_size - tx_buf.len < FRAME_MIN_LEN) {
+            int r = flush_pending_msgs();
+            if (r == -EAGAIN)
+                return r;
+        }
+
+        return pbuf->len;
+    }
+
+    /* Keep ordering with frames already batched */
+    if (tx_buf.len > 0) {
+        int r = flush_pending_msgs();
+        if (r == -EAGAIN)
+            return r;
+    }
+
+    ssize_t r = _send(pbuf->data, pbuf->len);
+    if (r == -EAGAIN && _queue) {
+        _queue->push(pbuf, frame);
+        return r;
+    }
+    if (r < 0)
+        return r;
+
+    _write_total++;
+    _datagrams_total++;
+
+    return r;
+}
+
+int UdpEndpoint::flush_pending_msgs()
+{
+    if (_queue) {
+        struct buffer buf;
+
+        while (_queue->front(&buf)) {
+            ssize_t r = _send(buf.data, buf.len);
+            if (r == -EAGAIN)
+                return r;
+
+            /* On any other error the packet is lost, as when not queued */
+            if (r > 0) {
+                _write_total++;
+                _datagrams_total++;
+            }
+            _queue->pop();
+        }
+
+        return 0;
+    }
+
+    if (tx_buf.len == 0)
+        return 0;
+
+    ssize_t r = _send(tx_buf.data, tx_buf.len);
+    if (r == -EAGAIN) {
+        /* we will be called again when socket is writable */
+        _flush_deadline = USEC_INFINITY;
+        return r;
+    }
+
+    if (r > 0) {
+        /* IP and UDP headers we didn't send for the frames after the first */
+        size_t overhead = sockaddr.ss_family == AF_INET6 ? 48 : 28;
+
+        _batched_total += _batch_msgs;
+        _datagrams_total++;
+        _header_bytes_saved += (_batch_msgs - 1) * overhead;
+    }
+
+    /* On any other error the batch is lost, as a single packet would be */
+    tx_buf.len = 0;
+    _batch_msgs = 0;
+    _flush_deadline = USEC_INFINITY;
+
+    return r < 0 ? r : 0;
+}
+
+int UdpEndpoint::set_batching(unsigned int max_size, usec_t delay)
+{
+    if (max_size > TX_BUF_MAX_SIZE)
+        return -EINVAL;
+
+    _batch_max_size = max_size;
+    _batch_delay = delay;
+
+    return 0;
+}
+
+void UdpEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+
+    if (_queue) {
+        printf("Conflation {" \
+               "\n\tqueued messages: %u" \
+               "\n\tmessages conflated: %u" \
+               "\n\tmessages dropped: %u" \
+               "\n}" \
+               "\n",
+               _queue->size(), _queue->conflated_total, _queue->dropped_total);
+    }
+
+    if (!_batch_max_size)
+        return;
+
+    printf("Batching {" \
+           "\n\tdatagrams sent: %u" \
+           "\n\tmessages batched: %u" \
+           "\n\tmessages per datagram: %.1f" \
+           "\n\theader bytes saved: %" PRIu64 \
+           "\n}" \
+           "\n",
+           _datagrams_total, _batched_total,
+           _batched_total / (double) (_datagrams_total == 0 ? 1 : _datagrams_total),
+           _header_bytes_saved);
+}
+
+MonitorEndpoint::MonitorEndpoint(unsigned int sample_rate)
+    : _sample_rate{sample_rate ? sample_rate : 1}
+    , _wrap{TX_BUF_MAX_SIZE}
+{
+    _name = "Monitor";
+}
+
+ssize_t MonitorEndpoint::_read_msg(uint8_t *buf, size_t len)
+{
+    /* Nothing goes from a monitor into the routing: just drain the socket */
+    while (::recv(fd, buf, len, 0) >= 0)
+        ;
+
+    if (errno == EAGAIN)
+        return 0;
+
+    return -errno;
+}
+
+bool MonitorEndpoint::_ring_push(const struct buffer *pbuf)
+{
+    const size_t rec_len = sizeof(uint16_t) + pbuf->len;
+    uint16_t len = pbuf->len;
+
+    if (_queued == 0) {
+        _head = _tail = 0;
+        _wrap = TX_BUF_MAX_SIZE;
+    } else if (_head == _tail) {
+        /* full */
+        return false;
+    }
+
+    if (_head >= _tail) {
+        /* free space is [_head, end) and [0, _tail) */
+        if (TX_BUF_MAX_SIZE - _head < rec_len) {
+            if (_tail < rec_len)
+                return false;
+            _wrap = _head;
+            _head = 0;
+        }
+    } else if (_tail - _head < rec_len) {
+        return false;
+    }
+
+    memcpy(tx_buf.data + _head, &len, sizeof(len));
+    memcpy(tx_buf.data + _head + sizeof(len), pbuf->data, pbuf->len);
+    _head += rec_len;
+    _queued++;
+
+    return true;
+}
+
+int MonitorEndpoint::flush_pending_msgs()
+{
+    while (_queued > 0) {
+        uint16_t len;
+
+        if (_tail == _wrap) {
+            _tail = 0;
+            _wrap = TX_BUF_MAX_SIZE;
+        }
+
+        memcpy(&len, tx_buf.data + _tail, sizeof(len));
+
+        ssize_t r = ::sendto(fd, tx_buf.data + _tail + sizeof(len), len, 0,
+                             (struct sockaddr *)&sockaddr, sockaddr_len);
+        if (r == -1 && errno == EAGAIN) {
+            _blocked = true;
+            return -EAGAIN;
+        }
+
+        /* On any other error the packet is lost, as for the other endpoints */
+        if (r != -1)
+            _write_total++;
+
+        _tail += sizeof(len) + len;
+        _queued--;
+    }
+
+    _blocked = false;
+
+    return 0;
+}
+
+int MonitorEndpoint::write_msg(const struct buffer *pbuf, const struct frame_info *frame)
+{
+    if (fd < 0) {
+        log_error("Trying to write invalid fd");
+        return -EINVAL;
+    }
+
+    if (++_sample_count < _sample_rate)
+        return 0;
+    _sample_count = 0;
+
+    if (!_ring_push(pbuf)) {
+        _dropped++;
+        return 0;
+    }
+
+    /* Wait to be notified it's writable again rather than retrying now */
+    if (_blocked)
+        return 0;
+
+    return flush_pending_msgs();
+}
+
+void MonitorEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+    printf("Monitor {"
+           "\n\tsample rate: 1/%u" \
+           "\n\tqueued messages: %u" \
+           "\n\tdropped messages: %u" \
+           "\n}" \
+           "\n",
+           _sample_rate, _queued, _dropped);
+}
+
+int CallbackEndpoint::write_msg(const struct buffer *pbuf, const struct frame_info *frame)
+{
+    _cb(pbuf, _data);
+    _write_total++;
+
+    return pbuf->len;
+}
+
+UnixEndpoint::UnixEndpoint()
+    : Endpoint{"Unix", false}
+{
+    _name_buf[0] = '\0';
+}
+
+UnixEndpoint::~UnixEndpoint()
+{
+    delete _queue;
+}
+
+void UnixEndpoint::enable_conflation()
+{
+    if (!_queue)
+        _queue = new ConflatingQueue{};
+}
+
+int UnixEndpoint::accept(int listener_fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    fd = accept4(listener_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        log_error_errno(errno, "Could not accept client (%m)");
+        return -1;
+    }
+
+    /* The kernel tells who the client is, it can't lie about it */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        log_error_errno(errno, "Could not get client credentials (%m)");
+        goto fail;
+    }
+
+    _pid = cred.pid;
+    _uid = cred.uid;
+    snprintf(_name_buf, sizeof(_name_buf), "Unix pid %d", (int) _pid);
+    _name = _name_buf;
+
+    log_info("Accepted local client pid %d uid %u", (int) _pid, (unsigned int) _uid);
+
+    return fd;
+
+fail:
+    ::close(fd);
+    fd = -1;
+    return -1;
+}
+
+ssize_t UnixEndpoint::_read_msg(uint8_t *buf, size_t len)
+{
+    ssize_t r = ::recv(fd, buf, len, 0);
+    if (r == -1 && errno == EAGAIN)
+        return 0;
+
+    /* Client closed the connection */
+    if (r == 0 || r == -1) {
+        hung_up = true;
+        return r == 0 ? -ECONNRESET : -errno;
+    }
+
+    _rx_timestamp = now_realtime_nsec();
+
+    return r;
+}
+
+int UnixEndpoint::write_msg(const struct buffer *pbuf, const struct frame_info *frame)
+{
+    uint16_t len = pbuf->len;
+
+    if (hung_up)
+        return -ECONNRESET;
+
+    /* Keep order with what's already queued */
+    if (_queued == 0 && (!_queue || _queue->empty())) {
+        ssize_t r = ::send(fd, pbuf->data, pbuf->len, MSG_NOSIGNAL);
+        if (r >= 0) {
+            _write_total++;
+            return r;
+        }
+
+        if (errno != EAGAIN) {
+            if (errno == EPIPE || errno == ECONNRESET)
+                hung_up = true;
+            else
+                log_error_errno(errno, "Error sending to local client (%m)");
+            return -errno;
+        }
+    }
+
+    if (_queue) {
+        _queue->push(pbuf, frame);
+        return -EAGAIN;
+    }
+
+    if (tx_buf.len + sizeof(len) + len > TX_BUF_MAX_SIZE) {
+        _dropped++;
+        return -EAGAIN;
+    }
+
+    memcpy(tx_buf.data + tx_buf.len, &len, sizeof(len));
+    memcpy(tx_buf.data + tx_buf.len + sizeof(len), pbuf->data, len);
+    tx_buf.len += sizeof(len) + len;
+    _queued++;
+
+    /* Let the mainloop know we want to be called when it's writable */
+    return -EAGAIN;
+}
+
+int UnixEndpoint::flush_pending_msgs()
+{
+    size_t pos = 0;
+    int ret = 0;
+
+    if (_queue) {
+        struct buffer buf;
+
+        while (_queue->front(&buf)) {
+            ssize_t r = ::send(fd, buf.data, buf.len, MSG_NOSIGNAL);
+            if (r == -1 && errno == EAGAIN)
+                return -EAGAIN;
+
+            if (r == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+                hung_up = true;
+                return -errno;
+            }
+
+            /* On any other error the packet is lost, as when not queued */
+            if (r != -1)
+                _write_total++;
+            _queue->pop();
+        }
+
+        return 0;
+    }
+
+    while (_queued > 0) {
+        uint16_t len;
+
+        memcpy(&len, tx_buf.data + pos, sizeof(len));
+
+        ssize_t r = ::send(fd, tx_buf.data + pos + sizeof(len), len, MSG_NOSIGNAL);
+        if (r == -1 && errno == EAGAIN) {
+            ret = -EAGAIN;
+            break;
+        }
+
+        if (r == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+            hung_up = true;
+            break;
+        }
+
+        /* On any other error the packet is lost, as for the other endpoints */
+        if (r != -1)
+            _write_total++;
+
+        pos += sizeof(len) + len;
+        _queued--;
+    }
+
+    tx_buf.len -= pos;
+    if (tx_buf.len > 0)
+        memmove(tx_buf.data, tx_buf.data + pos, tx_buf.len);
+
+    return ret;
+}
+
+void UnixEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+    printf("Unix {"
+           "\n\tpid: %d" \
+           "\n\tuid: %u" \
+           "\n\tqueued messages: %u" \
+           "\n\tdropped messages: %u" \
+           "\n}" \
+           "\n",
+           (int) _pid, (unsigned int) _uid, _queued, _dropped);
+
+    if (_queue) {
+        printf("Conflation {" \
+               "\n\tqueued messages: %u" \
+               "\n\tmessages conflated: %u" \
+               "\n\tmessages dropped: %u" \
+               "\n}" \
+               "\n",
+               _queue->size(), _queue->conflated_total, _queue->dropped_total);
+    }
+}
+
+VirtualEndpoint::VirtualEndpoint(const char *name, bool crc_check_enabled)
+    : Endpoint{name, crc_check_enabled}
+{
+    _input = (uint8_t *) malloc(RX_BUF_MAX_SIZE);
+    assert(_input);
+}
+
+VirtualEndpoint::~VirtualEndpoint()
+{
+    free(_input);
+}
+
+int VirtualEndpoint::inject(const uint8_t *data, size_t len)
+{
+    /* compact what was already read */
+    if (_input_pos > 0) {
+        _input_len -= _input_pos;
+        memmove(_input, _input + _input_pos, _input_len);
+        _input_pos = 0;
+    }
+
+    if (len > RX_BUF_MAX_SIZE - _input_len)
+        return -ENOBUFS;
+
+    memcpy(_input + _input_len, data, len);
+    _input_len += len;
+
+    return 0;
+}
+
+ssize_t VirtualEndpoint::_read_msg(uint8_t *buf, size_t len)
+{
+    size_t avail = _input_len - _input_pos;
+
+    if (avail == 0)
+        return 0;
+
+    if (len > avail)
+        len = avail;
+
+    memcpy(buf, _input + _input_pos, len);
+    _input_pos += len;
+
+    _rx_timestamp = now_realtime_nsec();
+
+    return len;
+}
+
+int VirtualEndpoint::write_msg(const struct buffer *pbuf, const struct frame_info *frame)
+{
+    if (pbuf->len > TX_BUF_MAX_SIZE - tx_buf.len) {
+        _dropped++;
+        return -ENOBUFS;
+    }
+
+    memcpy(tx_buf.data + tx_buf.len, pbuf->data, pbuf->len);
+    tx_buf.len += pbuf->len;
+    _write_total++;
+
+    return pbuf->len;
+}
+
+void VirtualEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+    printf("Virtual {"
+           "\n\tdropped messages: %u" \
+           "\n}" \
+           "\n",
+           _dropped);
 }
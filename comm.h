@@ -22,43 +22,203 @@
 #include <errno.h>
 #include <inttypes.h>
 
+#include "histogram.h"
+#include "timer.h"
+#include "util.h"
+
+/* Components per endpoint the router can write packets on behalf of */
+#define ENDPOINT_MAX_SEQ_SHIFTS 4
+
+class ConflatingQueue;
+struct frame_info;
+struct msg_meta;
+class Mainloop;
+
 struct buffer {
     unsigned int len;
     uint8_t *data;
 };
 
-class Endpoint {
+class _public_ Endpoint {
 public:
     Endpoint(const char *name, bool crc_check_enabled);
     virtual ~Endpoint();
 
-    int read_msg(struct buffer *pbuf);
-    void print_statistics();
-    virtual int write_msg(const struct buffer *pbuf) = 0;
+    /* Next packet received, in @pbuf, with its descriptor in @frame */
+    int read_msg(struct buffer *pbuf, struct frame_info *frame);
+    virtual void print_statistics();
+    /* Write packet @pbuf, described by @frame as read_msg() would have */
+    virtual int write_msg(const struct buffer *pbuf, const struct frame_info *frame) = 0;
     virtual int flush_pending_msgs() = 0;
 
+    /*
+     * CLOCK_REALTIME at which the packet returned by the last read_msg()
+     * was received, or 0 if unknown
+     */
+    nsec_t rx_timestamp() const { return _rx_timestamp; }
+
+    /* Account time a packet from @from took to be written to this endpoint */
+    void record_dwell(const Endpoint *from, nsec_t dwell);
+    /* Drop statistics about @peer, which is going away */
+    void forget_peer(const Endpoint *peer);
+
+    /*
+     * Allocate now what would otherwise be allocated when packets start
+     * flowing, for up to @n_peers endpoints sending to this one
+     */
+    void preallocate(unsigned int n_peers);
+    /* Upper bound of the memory used by an endpoint, buffers included */
+    static size_t footprint(unsigned int n_peers);
+
+    /*
+     * Liveness: if nothing is received for @timeout the peer is considered
+     * gone and the endpoint is parked: only one packet every
+     * @probe_interval is sent, to let the peer know we are still here. The
+     * next packet received makes it active again. A timeout of 0 disables it.
+     */
+    void set_liveness(usec_t timeout, usec_t probe_interval);
+    usec_t liveness_timeout() const { return _liveness_timeout; }
+
+    /* Whether a packet should be written now, parking the endpoint if needed */
+    bool liveness_check(usec_t now);
+
+    /* Park right away, e.g. if peer is known to be unreachable */
+    void park(usec_t now);
+
+    /*
+     * Time by which flush_pending_msgs() must be called to send data held
+     * back by the endpoint, USEC_INFINITY if there's none
+     */
+    usec_t flush_deadline() const { return _flush_deadline; }
+
+    /*
+     * Packets the router makes up on behalf of a component, e.g. replies
+     * from the cache, must not start a second sequence from it: the one
+     * written to this endpoint takes the seq after @last_seq, the last one
+     * the component sent, returned by take_seq(), and what the component
+     * sends afterwards is renumbered by renumber() to follow it, until the
+     * seqs it skips have made up for the packets added. Returns -ENOSPC if
+     * there are too many such components already.
+     */
+    int take_seq(uint8_t sysid, uint8_t compid, uint8_t last_seq);
+    bool renumbering() const { return _n_seq_shifts > 0; }
+    /*
+     * Copy @buf renumbered to @out and its descriptor to @out_frame, false if
+     * it doesn't need to be
+     */
+    bool renumber(const struct buffer *buf, const struct frame_info *frame,
+                  struct buffer *out, struct frame_info *out_frame);
+
     struct buffer rx_buf;
     struct buffer tx_buf;
     int fd = -1;
+    unsigned int id = 0;
+    /* Peer went away: the endpoint should be removed */
+    bool hung_up = false;
+    /*
+     * Goes to another router: packets coming back from it are dropped, with
+     * Mainloop::enable_mesh()
+     */
+    bool router_link = false;
+
+    /* Set by the Mainloop the endpoint is added to, for flush_deadline() */
+    Mainloop *mainloop = nullptr;
+    struct timer flush_timer = { };
 
 protected:
     virtual ssize_t _read_msg(uint8_t *buf, size_t len) = 0;
-    bool _check_crc();
+    /* parse the packet at _rx_pos in rx_buf, -EBADMSG if it's bad */
+    int _parse_msg(struct buffer *pbuf, struct frame_info *frame);
+    /* check payload length of the packet at _rx_pos */
+    bool _check_len(const struct frame_info *frame, const struct msg_meta *meta);
+    /* check CRC of the packet at _rx_pos */
+    bool _check_crc(const struct frame_info *frame, const struct msg_meta *meta);
+    /* drop @len bytes at _rx_pos, without moving any */
+    void _consume(size_t len);
+    /* drop a bad packet that claimed @claimed_len bytes up to the next start byte */
+    void _resync(size_t claimed_len);
+    /* account sequence number of a packet from sysid/compid */
+    void _account_seq(uint8_t sysid, uint8_t compid, uint8_t seq);
 
     const char *_name;
     size_t _last_packet_len = 0;
+    /* offset in rx_buf of the bytes not parsed yet, moved to 0 before reads */
+    size_t _rx_pos = 0;
 
     uint32_t _read_crc_errors = 0;
+    uint32_t _read_len_errors = 0;
+    uint32_t _resync_total = 0;
+    uint32_t _recovered_total = 0;
+    /* bytes ahead that a bad packet claimed, that used to be skipped */
+    size_t _resync_window = 0;
     uint32_t _read_total = 0;
     uint32_t _write_total = 0;
     const bool _crc_check_enabled;
+
+    nsec_t _rx_timestamp = 0;
+    usec_t _flush_deadline = USEC_INFINITY;
+
+    usec_t _liveness_timeout = 0;
+    usec_t _probe_interval = 0;
+    usec_t _last_rx_usec = 0;
+    usec_t _next_probe_usec = 0;
+    bool _parked = false;
+    uint32_t _parked_total = 0;
+    uint32_t _reactivated_total = 0;
+    uint32_t _suppressed_total = 0;
+
+    /* Histograms of the time packets spend in the router, per ingress */
+    struct dwell_stats {
+        const Endpoint *from;
+        struct histogram hist;
+    };
+    struct dwell_stats *_dwell = nullptr;
+    unsigned int _n_dwell = 0;
+    unsigned int _dwell_capacity = 0;
+
+    /*
+     * Link quality per source, from MAVLink sequence numbers: fixed-size
+     * hash table indexed by sysid/compid, allocated on first packet
+     */
+    struct seq_stats {
+        uint8_t sysid;
+        uint8_t compid;
+        uint8_t last_seq;
+        bool used;
+        uint32_t received;
+        uint32_t lost;
+        uint32_t duplicates;
+        uint32_t reordered;
+        /* bit n: seq last_seq - 1 - n was skipped, i.e. counted as lost */
+        uint64_t missing;
+        /* smoothed variation of inter-arrival time, as RTP's jitter (ns) */
+        uint32_t jitter;
+        nsec_t last_arrival;
+        nsec_t last_interval;
+    };
+    struct seq_stats *_seq_stats = nullptr;
+    uint32_t _seq_untracked = 0;
+
+    /*
+     * Packets made up on behalf of each component, modulo 256, not yet
+     * absorbed by packets the component lost on the way to the router
+     */
+    struct seq_shift {
+        uint8_t sysid;
+        uint8_t compid;
+        uint8_t shift;
+        /* as the component sent it */
+        uint8_t last_seq;
+    };
+    struct seq_shift _seq_shifts[ENDPOINT_MAX_SEQ_SHIFTS];
+    unsigned int _n_seq_shifts = 0;
 };
 
-class UartEndpoint : public Endpoint {
+class _public_ UartEndpoint : public Endpoint {
 public:
     UartEndpoint() : Endpoint{"UART", true} { }
     virtual ~UartEndpoint() { }
-    int write_msg(const struct buffer *pbuf) override;
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override;
     int flush_pending_msgs() override { return -ENOSYS; }
 
     int open(const char *path, speed_t baudrate);
@@ -66,18 +226,204 @@ protected:
     ssize_t _read_msg(uint8_t *buf, size_t len) override;
 };
 
-class UdpEndpoint : public Endpoint {
+class _public_ UdpEndpoint : public Endpoint {
 public:
     UdpEndpoint();
-    virtual ~UdpEndpoint() { }
+    virtual ~UdpEndpoint();
+
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override;
+    int flush_pending_msgs() override;
+    void print_statistics() override;
+
+    int open(const char *ip, unsigned long port, int mcast_ttl = 1, bool mcast_loop = false);
+
+    /*
+     * Pack several frames in each datagram, up to @max_size bytes. A
+     * datagram is sent when no other frame fits or @delay after its first
+     * frame was queued. MAVLink is self-framing, so any parser on the other
+     * side splits them again. A max_size of 0 disables it.
+     */
+    int set_batching(unsigned int max_size, usec_t delay);
+
+    /* Ask the kernel to busy poll the device queue for @usec on reads */
+    int set_busy_poll(unsigned int usec);
+
+    /*
+     * Queue packets the socket can't take instead of dropping them,
+     * keeping only the latest of each state message, see ConflatingQueue.
+     * This only happens when our own send buffer is full: a slow receiver,
+     * even on loopback, drops datagrams in its receive buffer without the
+     * router knowing. Local consumers get flow control with UnixEndpoint.
+     */
+    void enable_conflation();
+
+    /*
+     * Ingress mode: bind to ip:port and answer to whoever talked to us last.
+     * With n_shards > 1 this is one of n_shards SO_REUSEPORT sockets sharing
+     * the port; datagrams are steered to the shards by MAVLink sysid. This
+     * only spreads the kernel receive buffering: the shards are endpoints
+     * read by the routing thread like any other.
+     */
+    int open_ingress(const char *ip, unsigned long port,
+                     unsigned int shard = 0, unsigned int n_shards = 1);
+
+    struct sockaddr_storage sockaddr;
+    socklen_t sockaddr_len = 0;
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override;
+
+    int _parse_address(const char *ip, unsigned long port);
+    int _setup_multicast(int ttl, bool loop);
+    int _join_multicast();
+    int _enable_timestamps();
+    int _attach_sysid_steering(unsigned int n_shards);
+    ssize_t _send(const uint8_t *data, size_t len);
+
+    /*
+     * Multicast endpoints always transmit to the group: replies coming
+     * back from each station must not replace the destination address
+     */
+    bool _multicast = false;
+
+    /* batching: frames pending in tx_buf */
+    unsigned int _batch_max_size = 0;
+    usec_t _batch_delay = 0;
+    unsigned int _batch_msgs = 0;
+    uint32_t _batched_total = 0;
+    uint32_t _datagrams_total = 0;
+    uint64_t _header_bytes_saved = 0;
+
+    ConflatingQueue *_queue = nullptr;
+};
+
+/*
+ * Eavesdrop endpoint: gets a copy of the traffic in both directions, but
+ * nothing it sends is routed. Packets are queued in a ring on tx_buf and
+ * sent as the socket allows; when the ring is full packets are dropped
+ * here so a slow consumer can't hold back the routing. With a sample rate
+ * of N only 1 in N packets is queued.
+ */
+class _public_ MonitorEndpoint : public UdpEndpoint {
+public:
+    MonitorEndpoint(unsigned int sample_rate = 1);
+    virtual ~MonitorEndpoint() { }
+
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override;
+    int flush_pending_msgs() override;
+    void print_statistics() override;
 
-    int write_msg(const struct buffer *pbuf) override;
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override;
+
+    bool _ring_push(const struct buffer *pbuf);
+
+    const unsigned int _sample_rate;
+    unsigned int _sample_count = 0;
+
+    /* ring of [uint16_t len][data] records in tx_buf */
+    size_t _head = 0;
+    size_t _tail = 0;
+    size_t _wrap;
+    unsigned int _queued = 0;
+    bool _blocked = false;
+
+    uint32_t _dropped = 0;
+};
+
+/*
+ * In-process endpoint: packets routed to it are handed to a callback,
+ * pointing to the router's own buffer, without any copy or syscall. The
+ * buffer is only valid during the callback. Packets from the application
+ * are injected with Mainloop::route_msg().
+ */
+class _public_ CallbackEndpoint : public Endpoint {
+public:
+    typedef void (*callback_t)(const struct buffer *buf, void *data);
+
+    CallbackEndpoint(const char *name, callback_t cb, void *data)
+        : Endpoint{name, false}
+        , _cb{cb}
+        , _data{data}
+    {
+    }
+    virtual ~CallbackEndpoint() { }
+
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override;
     int flush_pending_msgs() override { return -ENOSYS; }
 
-    int open(const char *ip, unsigned long port);
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
 
-    struct sockaddr_in sockaddr;
+    callback_t _cb;
+    void *_data;
+};
+
+/*
+ * Client of the AF_UNIX SOCK_SEQPACKET listener: each record carries
+ * MAVLink frames, never split among records. Unlike UDP, packets the socket
+ * can't take right away are queued in tx_buf and sent when it's writable;
+ * they are only dropped if the client doesn't read for long enough to fill
+ * the queue.
+ */
+class _public_ UnixEndpoint : public Endpoint {
+public:
+    UnixEndpoint();
+    virtual ~UnixEndpoint();
+
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override;
+    int flush_pending_msgs() override;
+    void print_statistics() override;
+
+    int accept(int listener_fd);
+
+    /*
+     * Queue packets in a ConflatingQueue instead of tx_buf, keeping only the
+     * latest of each state message while the client is behind
+     */
+    void enable_conflation();
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override;
+
+    /* [uint16_t len][data] records waiting in tx_buf */
+    unsigned int _queued = 0;
+    uint32_t _dropped = 0;
+    ConflatingQueue *_queue = nullptr;
+
+    pid_t _pid = 0;
+    uid_t _uid = 0;
+    char _name_buf[32];
+};
+
+/*
+ * In-memory endpoint, for simulation and load testing: no fd and no syscall.
+ * Bytes given to inject() are read by the router as if they came from a
+ * device when Mainloop::handle_read() is called on it, and packets routed to
+ * it are appended to output(). When the output is full, packets are dropped.
+ */
+class _public_ VirtualEndpoint : public Endpoint {
+public:
+    VirtualEndpoint(const char *name = "Virtual", bool crc_check_enabled = false);
+    virtual ~VirtualEndpoint();
+
+    int write_msg(const struct buffer *pbuf, const struct frame_info *frame) override;
+    int flush_pending_msgs() override { return 0; }
+    void print_statistics() override;
+
+    /* Queue bytes to be read by the router. Returns -ENOBUFS if they don't fit */
+    int inject(const uint8_t *data, size_t len);
+
+    /* Packets written by the router since the last clear_output() */
+    const struct buffer *output() const { return &tx_buf; }
+    void clear_output() { tx_buf.len = 0; }
 
 protected:
     ssize_t _read_msg(uint8_t *buf, size_t len) override;
+
+    uint8_t *_input;
+    size_t _input_len = 0;
+    size_t _input_pos = 0;
+
+    uint32_t _dropped = 0;
 };
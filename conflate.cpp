@@ -0,0 +1,152 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "conflate.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mavlink.h>
+
+#include "frame.h"
+
+/* Queue length, power of 2. Can be set at build time */
+#ifndef CONFLATE_QUEUE_SIZE
+#define CONFLATE_QUEUE_SIZE 256U
+#endif
+#define QUEUE_SIZE CONFLATE_QUEUE_SIZE
+
+struct ConflatingQueue::entry {
+    /* msgid << 16 | sysid << 8 | compid, or 0 for events */
+    uint64_t key;
+    uint16_t len;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+};
+
+/* Messages whose newest value supersedes the previous ones */
+static bool is_state_msg(uint32_t msgid)
+{
+    switch (msgid) {
+    case MAVLINK_MSG_ID_HEARTBEAT:
+    case MAVLINK_MSG_ID_SYS_STATUS:
+    case MAVLINK_MSG_ID_SYSTEM_TIME:
+    case MAVLINK_MSG_ID_GPS_RAW_INT:
+    case MAVLINK_MSG_ID_SCALED_IMU:
+    case MAVLINK_MSG_ID_RAW_IMU:
+    case MAVLINK_MSG_ID_SCALED_PRESSURE:
+    case MAVLINK_MSG_ID_ATTITUDE:
+    case MAVLINK_MSG_ID_ATTITUDE_QUATERNION:
+    case MAVLINK_MSG_ID_LOCAL_POSITION_NED:
+    case MAVLINK_MSG_ID_GLOBAL_POSITION_INT:
+    case MAVLINK_MSG_ID_SERVO_OUTPUT_RAW:
+    case MAVLINK_MSG_ID_MISSION_CURRENT:
+    case MAVLINK_MSG_ID_NAV_CONTROLLER_OUTPUT:
+    case MAVLINK_MSG_ID_RC_CHANNELS:
+    case MAVLINK_MSG_ID_VFR_HUD:
+    case MAVLINK_MSG_ID_POSITION_TARGET_LOCAL_NED:
+    case MAVLINK_MSG_ID_POSITION_TARGET_GLOBAL_INT:
+    case MAVLINK_MSG_ID_HIGHRES_IMU:
+    case MAVLINK_MSG_ID_RADIO_STATUS:
+    case MAVLINK_MSG_ID_ALTITUDE:
+    case MAVLINK_MSG_ID_BATTERY_STATUS:
+    case MAVLINK_MSG_ID_ESTIMATOR_STATUS:
+    case MAVLINK_MSG_ID_VIBRATION:
+    case MAVLINK_MSG_ID_HOME_POSITION:
+    case MAVLINK_MSG_ID_EXTENDED_SYS_STATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+ConflatingQueue::ConflatingQueue()
+{
+    _entries = (struct entry *) malloc(QUEUE_SIZE * sizeof(*_entries));
+    assert(_entries);
+}
+
+ConflatingQueue::~ConflatingQueue()
+{
+    free(_entries);
+}
+
+size_t ConflatingQueue::footprint()
+{
+    return sizeof(ConflatingQueue) + QUEUE_SIZE * sizeof(struct entry);
+}
+
+bool ConflatingQueue::push(const struct buffer *buf, const struct frame_info *frame)
+{
+    const uint32_t msgid = frame->msgid;
+    uint64_t key = 0;
+    struct entry *e;
+
+    if (buf->len > sizeof(e->data)) {
+        dropped_total++;
+        return false;
+    }
+
+    if (is_state_msg(msgid)) {
+        /* + 1 so HEARTBEAT, msgid 0, isn't mistaken for an event */
+        key = ((uint64_t) msgid + 1) << 16 | frame->sysid << 8 | frame->compid;
+
+        /* Only scanned while the consumer is behind */
+        for (unsigned int i = 0; i < _count; i++) {
+            e = &_entries[(_head + i) & (QUEUE_SIZE - 1)];
+            if (e->key == key) {
+                memcpy(e->data, buf->data, buf->len);
+                e->len = buf->len;
+                conflated_total++;
+                return true;
+            }
+        }
+    }
+
+    if (_count == QUEUE_SIZE) {
+        dropped_total++;
+        return false;
+    }
+
+    e = &_entries[(_head + _count) & (QUEUE_SIZE - 1)];
+    e->key = key;
+    e->len = buf->len;
+    memcpy(e->data, buf->data, buf->len);
+    _count++;
+
+    return true;
+}
+
+bool ConflatingQueue::front(struct buffer *buf)
+{
+    if (_count == 0)
+        return false;
+
+    buf->data = _entries[_head].data;
+    buf->len = _entries[_head].len;
+
+    return true;
+}
+
+void ConflatingQueue::pop()
+{
+    if (_count == 0)
+        return;
+
+    _head = (_head + 1) & (QUEUE_SIZE - 1);
+    _count--;
+}
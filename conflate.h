@@ -0,0 +1,62 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include "comm.h"
+
+/*
+ * Bounded send queue for consumers that fall behind. Messages that only
+ * report the current state of a vehicle (ATTITUDE, GLOBAL_POSITION_INT,
+ * SYS_STATUS...) have at most one slot per (sysid, compid, msgid): a newer
+ * packet overwrites the queued one in place, so the consumer gets the latest
+ * value instead of a backlog of stale ones. Any other message is an event
+ * and is kept in order; if the queue is full it's dropped.
+ */
+class ConflatingQueue {
+public:
+    ConflatingQueue();
+    ~ConflatingQueue();
+
+    /* Memory used by a queue, for the static footprint of mavlink-routerd */
+    _public_ static size_t footprint();
+
+    /*
+     * Queue packet @buf, described by @frame. Returns false if it was dropped
+     * because the queue is full.
+     */
+    bool push(const struct buffer *buf, const struct frame_info *frame);
+
+    /* Oldest packet, valid until pop() */
+    bool front(struct buffer *buf);
+    void pop();
+
+    bool empty() const { return _count == 0; }
+    unsigned int size() const { return _count; }
+
+    uint32_t conflated_total = 0;
+    uint32_t dropped_total = 0;
+
+private:
+    struct entry;
+
+    struct entry *_entries;
+    unsigned int _head = 0;
+    unsigned int _count = 0;
+};
@@ -0,0 +1,146 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "comm.h"
+#include "log.h"
+
+/*
+ * Static footprint mode: checks that the arena replaces the allocator of
+ * the whole process, linked as mavlink-routerd is. Once sealed, an
+ * allocation from our code, from libc, from the C++ runtime and from
+ * libmavlink-router must each abort. Logging from the main thread must not,
+ * even for the first time. Built and run by "make check" with
+ * --enable-static-footprint.
+ */
+
+enum allocation {
+    ALLOC_NEW,
+    ALLOC_LIBC,
+    ALLOC_CXX_RUNTIME,
+    ALLOC_LIBRARY,
+};
+
+static const char *allocation_names[] = {
+    "operator new",
+    "strdup()",
+    "std::string",
+    "new endpoint in libmavlink-router",
+};
+
+static void allocate(enum allocation what)
+{
+    switch (what) {
+    case ALLOC_NEW:
+        delete new int{1};
+        break;
+    case ALLOC_LIBC:
+        free(strdup("mavlink-router"));
+        break;
+    case ALLOC_CXX_RUNTIME: {
+        std::string s(1024, 'x');
+        break;
+    }
+    case ALLOC_LIBRARY:
+        delete new UdpEndpoint{};
+        break;
+    }
+}
+
+/* Allocate in a child, that must be killed by abort() */
+static bool aborts(enum allocation what)
+{
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        allocate(what);
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return false;
+
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+/* Log in a child, as mavlink-routerd does right after sealing */
+static bool logs()
+{
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        log_info("First message of the main thread");
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return false;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bool aborted[ARRAY_SIZE(allocation_names)];
+    bool logged, ok = true;
+
+    log_open();
+
+    if (arena_init(1024 * 1024) < 0)
+        goto fail;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(allocation_names); i++)
+        allocate((enum allocation) i);
+
+    if (arena_used() == 0) {
+        printf("allocations didn't come from the arena\n");
+        goto fail;
+    }
+
+    /* Even printf() allocates on first use: report after unsealing */
+    arena_set_sealed(true);
+    for (unsigned int i = 0; i < ARRAY_SIZE(allocation_names); i++)
+        aborted[i] = aborts((enum allocation) i);
+    logged = logs();
+    arena_set_sealed(false);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(allocation_names); i++) {
+        printf("%s after sealing: %s\n", allocation_names[i],
+               aborted[i] ? "aborted" : "NOT aborted");
+        ok = ok && aborted[i];
+    }
+    printf("log_info() after sealing: %s\n", logged ? "logged" : "NOT logged");
+    ok = ok && logged;
+
+    log_close();
+
+    return ok ? 0 : 1;
+
+fail:
+    log_close();
+    return 1;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * Converts between captures of mavlink-routerd (--capture) and tlogs as
+ * written by ground stations, e.g. to replay a tlog with --replay or to look
+ * at a capture in a ground station.
+ */
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    if (argc != 4 || (!streq(argv[1], "import") && !streq(argv[1], "export"))) {
+        printf("Usage: capture-convert import <tlog> <capture>\n"
+               "       capture-convert export <capture> <tlog>\n");
+        return -1;
+    }
+
+    log_open();
+
+    if (streq(argv[1], "import"))
+        r = capture_import_tlog(argv[2], argv[3]);
+    else
+        r = capture_export_tlog(argv[2], argv[3]);
+
+    log_close();
+
+    return r < 0 ? -1 : 0;
+}
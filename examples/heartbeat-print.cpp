@@ -16,23 +16,30 @@
  * limitations under the License.
  */
 
-#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <strings.h>
-#include <sys/socket.h>
-#include <unistd.h>
 
 #include <mavlink.h>
 
-static volatile bool g_should_exit;
+#include "comm.h"
+#include "log.h"
+#include "mainloop.h"
+#include "util.h"
+
+/*
+ * Embeds the router instead of connecting to mavlink-routerd: the UART is the
+ * master endpoint and this application is an in-process endpoint receiving
+ * every packet from it through a callback.
+ */
+
+static Mainloop *g_mainloop;
 
 static void exit_signal_handler(int signum)
 {
-    g_should_exit = true;
+    g_mainloop->request_exit();
 }
 
 static void setup_signal_handlers()
@@ -58,65 +65,57 @@ static void handle_new_message(const mavlink_message_t *msg)
     }
 }
 
+static void on_packet(const struct buffer *buf, void *data)
+{
+    mavlink_message_t msg{};
+    mavlink_status_t status{};
+
+    /* The router hands us exactly one packet per call */
+    for (unsigned int i = 0; i < buf->len; i++) {
+        if (mavlink_parse_char(MAVLINK_COMM_0, buf->data[i], &msg, &status))
+            handle_new_message(&msg);
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    struct sockaddr_in sockaddr;
-    const socklen_t addrlen = sizeof(sockaddr);
-    int port = 14550;
-    int fd;
+    unsigned long baudrate = 115200U;
+    Mainloop mainloop{};
+    UartEndpoint *uart;
+    CallbackEndpoint *app;
 
-    if (argc < 2) {
-        printf("Usage: heartbeat-print <ip>:<port>\n");
+    if (argc < 2 || (argc > 2 && safe_atoul(argv[2], &baudrate) < 0)) {
+        printf("Usage: heartbeat-print <uart> [baudrate]\n");
         return -1;
     }
 
+    g_mainloop = &mainloop;
     setup_signal_handlers();
 
-    fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd == -1) {
-        fprintf(stderr, "Could not create socket (%m)\n");
-        return 1;
-    }
-
-    char *ip = strdup(argv[1]);
-    char *portstr = strchrnul(ip, ':');
-    if (portstr && *portstr) {
-        *portstr = '\0';
-        port = atoi(portstr + 1);
-    }
-    printf("Connecting to: %s:%i\n", ip, port);
+    log_open();
 
-    bzero(&sockaddr, addrlen);
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_addr.s_addr = inet_addr(ip);
-    sockaddr.sin_port = htons(port);
+    if (mainloop.open() < 0)
+        goto fail;
 
-    if (bind(fd, (struct sockaddr *)&sockaddr, addrlen) == -1) {
-        fprintf(stderr, "Could not bind to %s:%d (%m)", ip, port);
-        return 1;
+    uart = new UartEndpoint{};
+    if (uart->open(argv[1], baudrate) < 0 || mainloop.add_endpoint(uart, true) < 0) {
+        delete uart;
+        goto fail;
     }
 
-    mavlink_message_t msg{};
-    mavlink_status_t status{};
-
-    while (!g_should_exit) {
-        uint8_t buf[1024];
-        ssize_t n = read(fd, buf, sizeof(buf));
-        if (n == -1) {
-            if (errno == EINTR)
-                continue;
-            break;
-        }
-
-        for (int i = 0; i < n; i++) {
-            if (mavlink_parse_char(MAVLINK_COMM_0, buf[i], &msg, &status))
-                handle_new_message(&msg);
-        }
-
+    app = new CallbackEndpoint{"heartbeat-print", on_packet, nullptr};
+    if (mainloop.add_endpoint(app) < 0) {
+        delete app;
+        goto fail;
     }
 
-    free(ip);
-    close(fd);
+    mainloop.loop();
+
+    log_close();
 
     return 0;
+
+fail:
+    log_close();
+    return 1;
 }
@@ -0,0 +1,273 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mavlink.h>
+
+#include "comm.h"
+#include "log.h"
+#include "mainloop.h"
+#include "util.h"
+
+/*
+ * Compares the local client transports: how many frames per second a client
+ * on the same machine gets from the router and how much CPU that costs, with
+ * the client behind loopback UDP (-e 127.0.0.1:port), an AF_UNIX
+ * SOCK_SEQPACKET socket (-u path) or, for an application embedding
+ * libmavlink-router, a CallbackEndpoint in the same process.
+ *
+ * A virtual vehicle endpoint as master is driven as fast as the client
+ * endpoint takes packets; socket clients read them in another thread. Unix
+ * clients get flow control, loopback UDP ones lose what doesn't fit in
+ * their receive buffer. The callback is run by the router itself, so its
+ * cost is in the router CPU.
+ */
+
+#define BATCH 64
+/* the client stops after this long without packets */
+#define CLIENT_IDLE_MSEC 200
+
+struct client {
+    int fd;
+    uint64_t frames;
+    nsec_t first, last;
+    struct rusage usage;
+};
+
+static nsec_t real_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts_nsec(&ts);
+}
+
+static double cpu_sec(const struct rusage *usage)
+{
+    return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / (double) USEC_PER_SEC
+        + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / (double) USEC_PER_SEC;
+}
+
+static void *client_run(void *data)
+{
+    struct client *c = (struct client *) data;
+    uint8_t buf[2048];
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+
+    while (poll(&pfd, 1, c->frames ? CLIENT_IDLE_MSEC : 10 * CLIENT_IDLE_MSEC) > 0) {
+        if (recv(c->fd, buf, sizeof(buf), 0) <= 0)
+            break;
+        if (!c->frames)
+            c->first = real_now();
+        c->last = real_now();
+        c->frames++;
+    }
+
+    getrusage(RUSAGE_THREAD, &c->usage);
+
+    return nullptr;
+}
+
+static Endpoint *open_udp(struct client *c)
+{
+    struct sockaddr_in addr = {};
+    socklen_t addrlen = sizeof(addr);
+    UdpEndpoint *udp;
+
+    c->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (c->fd < 0 || bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || getsockname(c->fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        log_error_errno(errno, "Could not open UDP client (%m)");
+        return nullptr;
+    }
+
+    udp = new UdpEndpoint{};
+    if (udp->open("127.0.0.1", ntohs(addr.sin_port)) < 0) {
+        delete udp;
+        return nullptr;
+    }
+
+    return udp;
+}
+
+static void client_cb(const struct buffer *buf, void *data)
+{
+    struct client *c = (struct client *) data;
+
+    if (!c->frames)
+        c->first = real_now();
+    c->last = real_now();
+    c->frames++;
+}
+
+static Endpoint *open_unix(struct client *c)
+{
+    struct sockaddr_un addr = {};
+    UnixEndpoint *local;
+    int listener;
+
+    /* abstract address, nothing to clean up */
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "local-bench-%d", (int) getpid());
+
+    listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener < 0 || c->fd < 0
+        || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listener, 1) < 0
+        || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error_errno(errno, "Could not open unix client (%m)");
+        if (listener >= 0)
+            close(listener);
+        return nullptr;
+    }
+
+    local = new UnixEndpoint{};
+    if (local->accept(listener) < 0) {
+        delete local;
+        local = nullptr;
+    }
+    close(listener);
+
+    return local;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long n_frames = 1000000;
+    uint8_t frames[BATCH * MAVLINK_MAX_PACKET_LEN];
+    size_t frames_len = 0;
+    struct client c = { -1, 0, 0, 0, {} };
+    VirtualEndpoint *vehicle;
+    Endpoint *local;
+    Mainloop mainloop;
+    struct rusage usage;
+    pthread_t thread;
+    uint64_t sent = 0;
+    nsec_t start, elapsed;
+    bool callback_client;
+
+    if (argc < 2
+        || (strcmp(argv[1], "udp") && strcmp(argv[1], "unix") && strcmp(argv[1], "callback"))
+        || (argc > 2 && (safe_atoul(argv[2], &n_frames) < 0 || n_frames == 0))) {
+        printf("Usage: local-bench udp|unix|callback [frames]\n");
+        return -1;
+    }
+    callback_client = !strcmp(argv[1], "callback");
+
+    log_open();
+
+    if (mainloop.open() < 0)
+        goto fail;
+
+    vehicle = new VirtualEndpoint{"vehicle", true};
+    if (mainloop.add_endpoint(vehicle, true) < 0) {
+        delete vehicle;
+        goto fail;
+    }
+
+    if (callback_client)
+        local = new CallbackEndpoint{"callback", client_cb, &c};
+    else if (!strcmp(argv[1], "unix"))
+        local = open_unix(&c);
+    else
+        local = open_udp(&c);
+    if (!local || mainloop.add_endpoint(local) < 0) {
+        delete local;
+        goto fail;
+    }
+
+    for (unsigned int i = 0; i < BATCH; i++) {
+        mavlink_heartbeat_t heartbeat{};
+        mavlink_message_t msg;
+
+        heartbeat.mavlink_version = 3;
+        mavlink_msg_heartbeat_encode_chan(1, 1, MAVLINK_COMM_0, &msg, &heartbeat);
+        frames_len += mavlink_msg_to_send_buffer(frames + frames_len, &msg);
+    }
+
+    if (!callback_client && pthread_create(&thread, nullptr, client_run, &c) != 0)
+        goto fail;
+
+    start = real_now();
+
+    while (sent < n_frames) {
+        /* As loop() does on EPOLLOUT: wait for the client to catch up */
+        if (local->tx_buf.len > 0) {
+            struct pollfd pfd = { local->fd, POLLOUT, 0 };
+
+            poll(&pfd, 1, -1);
+            mainloop.handle_canwrite(local);
+            continue;
+        }
+
+        vehicle->inject(frames, frames_len);
+        mainloop.handle_read(vehicle);
+        sent += BATCH;
+    }
+    while (local->tx_buf.len > 0) {
+        struct pollfd pfd = { local->fd, POLLOUT, 0 };
+
+        poll(&pfd, 1, -1);
+        mainloop.handle_canwrite(local);
+    }
+
+    elapsed = real_now() - start;
+    getrusage(RUSAGE_THREAD, &usage);
+    if (!callback_client)
+        pthread_join(thread, nullptr);
+
+    printf("%s: %" PRIu64 " frames sent in %.3f s, %" PRIu64 " received (%.1f%% lost)\n",
+           argv[1], sent, elapsed / (double) NSEC_PER_SEC, c.frames,
+           100.0 * (sent - c.frames) / sent);
+    if (c.frames > 1)
+        printf("%.0f frames/s received\n",
+               (c.frames - 1) * (double) NSEC_PER_SEC / (c.last - c.first));
+    printf("router CPU: %.2f s, %.0f ns/frame sent\n",
+           cpu_sec(&usage), cpu_sec(&usage) * NSEC_PER_SEC / sent);
+    if (c.frames && !callback_client)
+        printf("client CPU: %.2f s, %.0f ns/frame received\n",
+               cpu_sec(&c.usage), cpu_sec(&c.usage) * NSEC_PER_SEC / c.frames);
+
+    if (c.fd >= 0)
+        close(c.fd);
+    log_close();
+
+    return 0;
+
+fail:
+    if (c.fd >= 0)
+        close(c.fd);
+    log_close();
+    return 1;
+}
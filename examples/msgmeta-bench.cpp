@@ -0,0 +1,137 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <mavlink.h>
+
+#include "log.h"
+#include "msgmeta.h"
+#include "util.h"
+
+/*
+ * Compares the lookup of message metadata done for each packet: the table
+ * indexed by msgid generated by tools/msgmeta-gen.py against the binary
+ * search of mavlink_get_msg_entry(), over the msgids of the dialect this
+ * was built with, in random order.
+ *
+ * It fails if both don't agree on the metadata of every message.
+ */
+
+/* lookups per round, each of a msgid picked at random */
+#define N_LOOKUPS 4096
+
+static nsec_t real_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts_nsec(&ts);
+}
+
+static bool same_meta(uint32_t msgid)
+{
+    const struct msg_meta *meta = msg_meta_get(msgid);
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(msgid);
+
+    if (!meta || !entry)
+        return !meta && !entry;
+
+    return meta->crc_extra == entry->crc_extra && meta->min_len == entry->min_msg_len
+        && meta->max_len == entry->max_msg_len && meta->flags == entry->flags
+        && meta->target_system_ofs == entry->target_system_ofs
+        && meta->target_component_ofs == entry->target_component_ofs;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long n_rounds = 10000;
+    uint32_t *msgids = nullptr, lookups[N_LOOKUPS];
+    unsigned int n_msgids = 0, seed = 1;
+    unsigned int sum_table = 0, sum_search = 0;
+    nsec_t start, table, search;
+
+    if (argc > 1 && (safe_atoul(argv[1], &n_rounds) < 0 || n_rounds == 0)) {
+        printf("Usage: msgmeta-bench [rounds]\n");
+        return -1;
+    }
+
+    log_open();
+
+    msgids = (uint32_t *) malloc((msg_meta_max_id + 1) * sizeof(*msgids));
+    if (!msgids)
+        goto fail;
+
+    /* the ids in between too, unknown ones must be unknown to both */
+    for (uint32_t id = 0; id <= msg_meta_max_id + 1; id++) {
+        if (!same_meta(id)) {
+            printf("metadata of message %" PRIu32 " differs\n", id);
+            goto fail;
+        }
+        if (msg_meta_get(id))
+            msgids[n_msgids++] = id;
+    }
+
+    if (n_msgids == 0) {
+        printf("no messages known\n");
+        goto fail;
+    }
+
+    for (unsigned int i = 0; i < N_LOOKUPS; i++)
+        lookups[i] = msgids[rand_r(&seed) % n_msgids];
+
+    start = real_now();
+    for (unsigned long round = 0; round < n_rounds; round++) {
+        for (unsigned int i = 0; i < N_LOOKUPS; i++)
+            sum_table += msg_meta_get(lookups[i])->crc_extra;
+    }
+    table = real_now() - start;
+
+    start = real_now();
+    for (unsigned long round = 0; round < n_rounds; round++) {
+        for (unsigned int i = 0; i < N_LOOKUPS; i++)
+            sum_search += mavlink_get_msg_entry(lookups[i])->crc_extra;
+    }
+    search = real_now() - start;
+
+    printf("%u messages, highest msgid %" PRIu32 ", %lu lookups each\n",
+           n_msgids, msg_meta_max_id, n_rounds * N_LOOKUPS);
+    printf("msg_meta_get():          %.2f ns/lookup\n",
+           table / (double) (n_rounds * N_LOOKUPS));
+    printf("mavlink_get_msg_entry(): %.2f ns/lookup\n",
+           search / (double) (n_rounds * N_LOOKUPS));
+
+    /* also keeps the loops from being optimized away */
+    if (sum_table != sum_search) {
+        printf("lookups disagree\n");
+        goto fail;
+    }
+
+    free(msgids);
+    log_close();
+
+    return 0;
+
+fail:
+    free(msgids);
+    log_close();
+    return 1;
+}
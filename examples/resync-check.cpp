@@ -0,0 +1,172 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mavlink.h>
+
+#include "comm.h"
+#include "log.h"
+#include "mainloop.h"
+#include "util.h"
+
+/*
+ * Checks that the parser finds every good packet in a noisy stream, as
+ * from a UART picking up garbage: each packet follows noise that looks like
+ * the start of a packet, and the stream arrives in reads of random sizes.
+ * Then a read buffer full of bad headers to resync from must be gone
+ * through in linear time.
+ *
+ * It fails if any packet is not delivered; "make check" runs it.
+ */
+
+#define N_PACKETS 10000
+#define MAX_READ 64
+/* what fits in the read buffer of an endpoint with a packet */
+#define N_BAD_HEADERS 1300
+/* MAVLink 1 HEARTBEAT header with a payload too long for it */
+#define BAD_HEADER "\xfe\x0a\x00\x01\x01\x00"
+
+/* Headers that claim bytes that belong to the next packet, or a bad length */
+static const struct {
+    const uint8_t *data;
+    size_t len;
+} noises[] = {
+    { (const uint8_t *) "", 0 },
+    { (const uint8_t *) "\xfe\x09\x00\x01\x01\x00\x55", 7 },
+    { (const uint8_t *) "\xfe\xf0\x00\x01\x01\x00", 6 },
+    { (const uint8_t *) "\xfd\x09\x00\x00\x00\x01\x01\x00\x00\x00", 10 },
+    { (const uint8_t *) "\x55\xfd", 2 },
+};
+
+static nsec_t real_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts_nsec(&ts);
+}
+
+static size_t pack_heartbeat(uint8_t *buf)
+{
+    mavlink_heartbeat_t heartbeat{};
+    mavlink_message_t msg;
+
+    heartbeat.mavlink_version = 3;
+    mavlink_msg_heartbeat_encode_chan(1, 1, MAVLINK_COMM_0, &msg, &heartbeat);
+
+    return mavlink_msg_to_send_buffer(buf, &msg);
+}
+
+/* Feed @len bytes in reads of up to MAX_READ, returns the packets routed */
+static unsigned long feed(Mainloop *mainloop, VirtualEndpoint *vehicle, VirtualEndpoint *gcs,
+                          const uint8_t *data, size_t len, size_t frame_len, unsigned int *seed)
+{
+    unsigned long delivered = 0;
+
+    for (size_t pos = 0; pos < len;) {
+        size_t n = 1 + rand_r(seed) % MAX_READ;
+
+        if (n > len - pos)
+            n = len - pos;
+        vehicle->inject(data + pos, n);
+        pos += n;
+
+        mainloop->handle_read(vehicle);
+        delivered += gcs->output()->len / frame_len;
+        gcs->clear_output();
+    }
+
+    return delivered;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *stream = nullptr, frame[MAVLINK_MAX_PACKET_LEN];
+    size_t stream_len = 0, frame_len;
+    unsigned long delivered;
+    unsigned int seed = 1;
+    VirtualEndpoint *vehicle, *gcs;
+    Mainloop *mainloop;
+    nsec_t start;
+
+    log_open();
+    mainloop = new Mainloop{};
+
+    vehicle = new VirtualEndpoint{"vehicle", true};
+    if (mainloop->add_endpoint(vehicle, true) < 0) {
+        delete vehicle;
+        goto fail;
+    }
+
+    gcs = new VirtualEndpoint{"gcs"};
+    if (mainloop->add_endpoint(gcs) < 0) {
+        delete gcs;
+        goto fail;
+    }
+
+    frame_len = pack_heartbeat(frame);
+    stream = (uint8_t *) malloc(N_PACKETS * (frame_len + 16));
+    if (!stream)
+        goto fail;
+
+    for (unsigned int i = 0; i < N_PACKETS; i++) {
+        unsigned int noise = rand_r(&seed) % ARRAY_SIZE(noises);
+
+        memcpy(stream + stream_len, noises[noise].data, noises[noise].len);
+        stream_len += noises[noise].len;
+        stream_len += pack_heartbeat(stream + stream_len);
+    }
+
+    delivered = feed(mainloop, vehicle, gcs, stream, stream_len, frame_len, &seed);
+    printf("noisy stream: %lu of %u packets delivered\n", delivered, N_PACKETS);
+    if (delivered != N_PACKETS)
+        goto fail;
+
+    /* Each bad header is a resync, that used to move all the bytes after it */
+    stream_len = 0;
+    for (unsigned int i = 0; i < N_BAD_HEADERS; i++) {
+        memcpy(stream + stream_len, BAD_HEADER, sizeof(BAD_HEADER) - 1);
+        stream_len += sizeof(BAD_HEADER) - 1;
+    }
+    stream_len += pack_heartbeat(stream + stream_len);
+
+    start = real_now();
+    vehicle->inject(stream, stream_len);
+    mainloop->handle_read(vehicle);
+    delivered = gcs->output()->len / frame_len;
+    printf("%u bad headers gone through in %.3f ms, %lu of 1 packets delivered\n",
+           N_BAD_HEADERS, (real_now() - start) / (double) NSEC_PER_MSEC, delivered);
+    if (delivered != 1)
+        goto fail;
+
+    delete mainloop;
+    free(stream);
+    log_close();
+
+    return 0;
+
+fail:
+    delete mainloop;
+    free(stream);
+    log_close();
+    return 1;
+}
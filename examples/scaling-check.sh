@@ -0,0 +1,11 @@
+#!/bin/sh
+#
+# Run by "make check": the routing core must deliver every packet from one
+# to thousands of virtual endpoints. Arguments of virtual-bench are GCS
+# endpoints, vehicles behind the master and rounds.
+
+set -e
+
+./virtual-bench 1 1 10000
+./virtual-bench 64 254 100
+./virtual-bench 2000 254 5
@@ -0,0 +1,160 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mavlink.h>
+
+#include "comm.h"
+#include "log.h"
+#include "mainloop.h"
+#include "util.h"
+
+/*
+ * Measures how fast the routing core forwards packets without any I/O: a
+ * virtual vehicle endpoint as master and virtual GCS endpoints, driven
+ * synchronously with a simulated clock. Packets from the master carry many
+ * sysids, as if several vehicles were behind it.
+ *
+ * It fails if any packet is not delivered, so "make check" runs it as a
+ * scaling test, with up to thousands of endpoints.
+ */
+
+static usec_t sim_now = USEC_PER_SEC;
+
+static usec_t sim_clock()
+{
+    return sim_now;
+}
+
+/* The router runs on the simulated clock, the benchmark on the real one */
+static nsec_t real_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts_nsec(&ts);
+}
+
+static size_t pack_heartbeat(uint8_t *buf, uint8_t sysid, uint8_t compid)
+{
+    mavlink_heartbeat_t heartbeat{};
+    mavlink_message_t msg;
+
+    heartbeat.mavlink_version = 3;
+    mavlink_msg_heartbeat_encode_chan(sysid, compid, MAVLINK_COMM_0, &msg, &heartbeat);
+
+    return mavlink_msg_to_send_buffer(buf, &msg);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long n_gcs = 4, n_vehicles = 16, n_rounds = 100000;
+    uint8_t vehicle_frames[255 * MAVLINK_MAX_PACKET_LEN];
+    uint8_t gcs_frame[MAVLINK_MAX_PACKET_LEN];
+    size_t vehicle_len = 0, gcs_len;
+    VirtualEndpoint *vehicle, **gcs = nullptr;
+    Mainloop *mainloop;
+    uint64_t forwarded = 0, delivered = 0;
+    nsec_t start, elapsed;
+
+    if ((argc > 1 && (safe_atoul(argv[1], &n_gcs) < 0 || n_gcs == 0))
+        || (argc > 2 && (safe_atoul(argv[2], &n_vehicles) < 0 || n_vehicles == 0
+                         || n_vehicles > 254))
+        || (argc > 3 && safe_atoul(argv[3], &n_rounds) < 0)) {
+        printf("Usage: virtual-bench [gcs endpoints] [vehicles] [rounds]\n");
+        return -1;
+    }
+
+    log_open();
+    set_clock(sim_clock);
+    mainloop = new Mainloop{};
+
+    vehicle = new VirtualEndpoint{"vehicle", true};
+    if (mainloop->add_endpoint(vehicle, true) < 0) {
+        delete vehicle;
+        goto fail;
+    }
+
+    gcs = (VirtualEndpoint **) calloc(n_gcs, sizeof(*gcs));
+    if (!gcs)
+        goto fail;
+
+    for (unsigned long i = 0; i < n_gcs; i++) {
+        gcs[i] = new VirtualEndpoint{"gcs"};
+        if (mainloop->add_endpoint(gcs[i]) < 0) {
+            delete gcs[i];
+            goto fail;
+        }
+    }
+
+    for (unsigned long i = 0; i < n_vehicles; i++)
+        vehicle_len += pack_heartbeat(vehicle_frames + vehicle_len, i + 1, 1);
+    gcs_len = pack_heartbeat(gcs_frame, 255, 190);
+
+    start = real_now();
+
+    for (unsigned long round = 0; round < n_rounds; round++) {
+        vehicle->inject(vehicle_frames, vehicle_len);
+        mainloop->handle_read(vehicle);
+        forwarded += n_vehicles * n_gcs;
+
+        for (unsigned long i = 0; i < n_gcs; i++) {
+            delivered += gcs[i]->output()->len / (vehicle_len / n_vehicles);
+            gcs[i]->clear_output();
+            gcs[i]->inject(gcs_frame, gcs_len);
+            mainloop->handle_read(gcs[i]);
+            delivered += vehicle->output()->len / gcs_len;
+            vehicle->clear_output();
+        }
+        forwarded += n_gcs;
+
+        sim_now += USEC_PER_MSEC;
+        mainloop->run_timers(sim_now);
+    }
+
+    elapsed = real_now() - start;
+
+    /* what the last round sent to the GCSes is still in their output */
+    for (unsigned long i = 0; i < n_gcs; i++)
+        delivered += gcs[i]->output()->len / (vehicle_len / n_vehicles);
+
+    printf("%" PRIu64 " packets forwarded in %.3f s: %.0f packets/s, %.1f ns/packet\n",
+           forwarded, elapsed / (double) NSEC_PER_SEC,
+           forwarded * (double) NSEC_PER_SEC / elapsed, elapsed / (double) forwarded);
+
+    if (delivered != forwarded) {
+        printf("%" PRIu64 " packets not delivered\n", forwarded - delivered);
+        goto fail;
+    }
+
+    delete mainloop;
+    free(gcs);
+    log_close();
+
+    return 0;
+
+fail:
+    delete mainloop;
+    free(gcs);
+    log_close();
+    return 1;
+}
@@ -0,0 +1,224 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <string.h>
+
+#include <mavlink.h>
+
+#include "comm.h"
+#include "macro.h"
+#include "msgmeta.h"
+
+/*
+ * mavlink 2.0 packet in its wire format
+ *
+ * Packet size:
+ *      sizeof(mavlink_router_mavlink2_header)
+ *      + payload length
+ *      + 2 (checksum)
+ *      + signature (0 if not signed)
+ */
+struct _packed_ mavlink_router_mavlink2_header {
+    uint8_t magic;
+    uint8_t payload_len;
+    uint8_t incompat_flags;
+    uint8_t compat_flags;
+    uint8_t seq;
+    uint8_t sysid;
+    uint8_t compid;
+    uint32_t msgid : 24;
+};
+
+/*
+ * mavlink 1.0 packet in its wire format
+ *
+ * Packet size:
+ *      sizeof(mavlink_router_mavlink1_header)
+ *      + payload length
+ *      + 2 (checksum)
+ */
+struct _packed_ mavlink_router_mavlink1_header {
+    uint8_t magic;
+    uint8_t payload_len;
+    uint8_t seq;
+    uint8_t sysid;
+    uint8_t compid;
+    uint8_t msgid;
+};
+
+/* Smallest frame: mavlink 1 with an empty payload */
+#define FRAME_MIN_LEN (sizeof(struct mavlink_router_mavlink1_header) + MAVLINK_NUM_CHECKSUM_BYTES)
+
+/*
+ * Decode a complete frame as returned by Endpoint::read_msg() into @msg so
+ * it can be given to the mavlink_msg_*_decode() functions. Payload truncated
+ * by mavlink 2 is zero-filled. The checksum is not verified.
+ */
+static inline void frame_to_message(const struct buffer *buf, mavlink_message_t *msg)
+{
+    const uint8_t *payload;
+
+    memset(msg, 0, sizeof(*msg));
+
+    if (buf->data[0] == MAVLINK_STX) {
+        const struct mavlink_router_mavlink2_header *hdr =
+            (const struct mavlink_router_mavlink2_header *)buf->data;
+
+        msg->incompat_flags = hdr->incompat_flags;
+        msg->compat_flags = hdr->compat_flags;
+        msg->len = hdr->payload_len;
+        msg->seq = hdr->seq;
+        msg->sysid = hdr->sysid;
+        msg->compid = hdr->compid;
+        msg->msgid = hdr->msgid;
+        payload = buf->data + sizeof(*hdr);
+    } else {
+        const struct mavlink_router_mavlink1_header *hdr =
+            (const struct mavlink_router_mavlink1_header *)buf->data;
+
+        msg->len = hdr->payload_len;
+        msg->seq = hdr->seq;
+        msg->sysid = hdr->sysid;
+        msg->compid = hdr->compid;
+        msg->msgid = hdr->msgid;
+        payload = buf->data + sizeof(*hdr);
+    }
+
+    msg->magic = buf->data[0];
+    memcpy(_MAV_PAYLOAD_NON_CONST(msg), payload, msg->len);
+}
+
+/*
+ * Descriptor of a frame, filled once by Endpoint::read_msg() while parsing
+ * it and handed along with its bytes, so the stages after it (routing,
+ * filters, recorders, statistics) don't decode the header again. It's 32
+ * bytes to keep arrays of them two per cache line.
+ */
+struct frame_info {
+    /* CLOCK_REALTIME at which it was received, 0 if unknown */
+    nsec_t rx_timestamp;
+    uint32_t msgid;
+    /* id of the endpoint it was received on */
+    uint32_t ingress;
+    /* whole frame, signature included */
+    uint16_t len;
+    uint16_t crc;
+    /* -1 if the message has no such field, 0 for broadcast */
+    int16_t target_sysid;
+    int16_t target_compid;
+    /* 1 or 2 */
+    uint8_t version;
+    uint8_t payload_len;
+    uint8_t seq;
+    uint8_t sysid;
+    uint8_t compid;
+    bool is_signed;
+};
+
+static_assert(sizeof(struct frame_info) == 32, "frame_info should stay 32 bytes");
+
+static inline size_t frame_header_len(const struct frame_info *f)
+{
+    return f->version == 2 ? sizeof(struct mavlink_router_mavlink2_header)
+                           : sizeof(struct mavlink_router_mavlink1_header);
+}
+
+/* Fill @f from the header at @data, that must be complete */
+static inline void frame_parse_header(const uint8_t *data, struct frame_info *f)
+{
+    if (data[0] == MAVLINK_STX) {
+        const struct mavlink_router_mavlink2_header *hdr =
+            (const struct mavlink_router_mavlink2_header *)data;
+
+        f->version = 2;
+        f->payload_len = hdr->payload_len;
+        f->seq = hdr->seq;
+        f->sysid = hdr->sysid;
+        f->compid = hdr->compid;
+        f->msgid = hdr->msgid;
+        f->is_signed = hdr->incompat_flags & MAVLINK_IFLAG_SIGNED;
+        f->len = sizeof(*hdr) + hdr->payload_len + 2;
+        if (f->is_signed)
+            f->len += MAVLINK_SIGNATURE_BLOCK_LEN;
+    } else {
+        const struct mavlink_router_mavlink1_header *hdr =
+            (const struct mavlink_router_mavlink1_header *)data;
+
+        f->version = 1;
+        f->payload_len = hdr->payload_len;
+        f->seq = hdr->seq;
+        f->sysid = hdr->sysid;
+        f->compid = hdr->compid;
+        f->msgid = hdr->msgid;
+        f->is_signed = false;
+        f->len = sizeof(*hdr) + hdr->payload_len + 2;
+    }
+}
+
+/*
+ * Fill what's after the header in @f: checksum and targets. @meta is the
+ * msg_meta of the message, NULL if unknown.
+ */
+static inline void frame_parse_payload(const uint8_t *data, const struct msg_meta *meta,
+                                       struct frame_info *f)
+{
+    const uint8_t *payload = data + frame_header_len(f);
+    int target_sysid = -1, target_compid = -1;
+
+    f->crc = payload[f->payload_len] | payload[f->payload_len + 1] << 8;
+
+    if (meta)
+        msg_meta_get_target(meta, payload, f->payload_len, &target_sysid, &target_compid);
+    f->target_sysid = target_sysid;
+    f->target_compid = target_compid;
+}
+
+/*
+ * Change the seq of the complete, unsigned frame at @data described by @f,
+ * updating its checksum and @f. @meta is the msg_meta of the message.
+ */
+static inline void frame_set_seq(uint8_t *data, struct frame_info *f,
+                                 const struct msg_meta *meta, uint8_t seq)
+{
+    const size_t len = frame_header_len(f) + f->payload_len;
+    uint16_t crc;
+
+    if (f->version == 2)
+        ((struct mavlink_router_mavlink2_header *)data)->seq = seq;
+    else
+        ((struct mavlink_router_mavlink1_header *)data)->seq = seq;
+
+    crc = crc_calculate(data + 1, len - 1);
+    crc_accumulate(meta->crc_extra, &crc);
+    data[len] = crc & 0xff;
+    data[len + 1] = crc >> 8;
+
+    f->seq = seq;
+    f->crc = crc;
+}
+
+/* Descriptor of a complete frame that didn't come from read_msg() */
+static inline void frame_parse(const struct buffer *buf, unsigned int ingress,
+                               nsec_t rx_timestamp, struct frame_info *f)
+{
+    frame_parse_header(buf->data, f);
+    frame_parse_payload(buf->data, msg_meta_get(f->msgid), f);
+    f->ingress = ingress;
+    f->rx_timestamp = rx_timestamp;
+}
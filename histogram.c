@@ -0,0 +1,55 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "histogram.h"
+
+static uint64_t bucket_highest_value(unsigned int bucket)
+{
+    unsigned int exp;
+    uint64_t sub;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    exp = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exp - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+    uint64_t target, seen = 0;
+    unsigned int i;
+
+    if (h->count == 0)
+        return 0;
+
+    target = (uint64_t)(h->count * p / 100.0);
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t v = bucket_highest_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
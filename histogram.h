@@ -0,0 +1,70 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include "macro.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * HDR-like histogram: values are bucketed by their power of 2 and each
+ * power of 2 is split in HISTOGRAM_SUB_BUCKETS linear buckets, so the
+ * relative error is bounded (1/16) for any value. Recording is a couple of
+ * shifts and an increment.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1U << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (64 - HISTOGRAM_SUB_BITS + 1))
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static _always_inline_ unsigned int histogram_bucket(uint64_t value)
+{
+    unsigned int exp;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    exp = 63 - __builtin_clzll(value);
+
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + ((value >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static _always_inline_ void histogram_record(struct histogram *h, uint64_t value)
+{
+    h->buckets[histogram_bucket(value)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+/* Value at percentile @p (0-100), as the highest value of its bucket */
+_public_ uint64_t histogram_percentile(const struct histogram *h, double p);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,12 +18,18 @@
 
 #include <alloca.h>
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/eventfd.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
@@ -36,8 +42,14 @@
 #define COLOR_WHITE        "\033[37;1m"
 #define COLOR_RESET        "\033[0m"
 
+/* Per-thread ring for deferred messages: must be a power of 2 */
+#define LOG_RING_SIZE           (64U * 1024U)
+/* Max size of a deferred message, with all its arguments */
+#define LOG_RECORD_MAX          1024U
+/* Strings passed as argument are truncated to this */
+#define LOG_STRING_ARG_MAX      256U
 
-static int log_max_level = LOG_INFO;
+int _log_max_level = LOG_INFO;
 static int log_target_fd = STDERR_FILENO;
 static bool log_show_colors;
 
@@ -49,29 +61,77 @@ static const char *level_colors[] = {
     [LOG_DEBUG] =   COLOR_LIGHTBLUE,
 };
 
-int log_open(void)
-{
-    if (isatty(log_target_fd))
-        log_show_colors = true;
+/*
+ * A deferred message: header followed by the arguments as they are in
+ * memory, in the same order as in the format. Strings are copied with a
+ * uint16_t length prefix. Arguments are only decoded by the writer thread,
+ * which parses the format again to know their types.
+ */
+struct log_record {
+    uint32_t size;
+    int level;
+    int error;
+    int saved_errno;
+    int line;
+    const char *file;
+    const char *format;
+    uint8_t args[];
+};
 
-    return 0;
-}
+/*
+ * Single producer (the thread owning it), single consumer (the writer
+ * thread) ring. head and tail only increase; position is offset & mask.
+ */
+struct log_ring {
+    struct log_ring *next;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t dropped;
+    uint8_t data[LOG_RING_SIZE];
+};
 
-int log_close(void)
-{
-    return 0;
-}
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *log_thread_ring;
+
+static pthread_t log_writer;
+static bool log_async;
+static bool log_writer_stop;
+/*
+ * The writer blocks reading log_writer_fd when all rings are empty, after
+ * setting log_writer_waiting. Whoever sees it set wakes it up.
+ */
+static int log_writer_fd = -1;
+static bool log_writer_waiting;
+
+enum log_arg_type {
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_INTMAX,
+    LOG_ARG_SIZE,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STRING,
+    LOG_ARG_INVALID,
+};
+
+struct log_spec {
+    const char *start;
+    size_t len;
+    unsigned int n_stars;
+    enum log_arg_type type;
+    char conversion;
+};
 
 void log_set_max_level(int level)
 {
     assert((level & LOG_PRIMASK) == level);
 
-    log_max_level = level;
-}
-
-int log_get_max_level(void)
-{
-    return log_max_level;
+    _log_max_level = level;
 }
 
 static const char *get_color(int level)
@@ -81,21 +141,12 @@ static const char *get_color(int level)
     return level_colors[level];
 }
 
-static int log_internalv(int level, int error,
-                         const char *file, int line,
-                         const char *format, va_list ap)
+static void log_write(int level, const char *file, int line, const char *msg)
 {
     struct iovec iovec[6] = { };
     const char *color;
     int n = 0;
     char location[64];
-    char buffer[LINE_MAX];
-    int save_errno;
-
-    assert((level & LOG_PRIMASK) == level);
-
-    /* so %m works as expected */
-    save_errno = errno;
 
     color = get_color(level);
 
@@ -107,10 +158,7 @@ static int log_internalv(int level, int error,
     if (color)
         IOVEC_SET_STRING(iovec[n++], color);
 
-    errno = save_errno;
-    vsnprintf(buffer, sizeof(buffer), format, ap);
-
-    IOVEC_SET_STRING(iovec[n++], buffer);
+    IOVEC_SET_STRING(iovec[n++], msg);
 
     if (color)
         IOVEC_SET_STRING(iovec[n++], COLOR_RESET);
@@ -118,6 +166,560 @@ static int log_internalv(int level, int error,
     IOVEC_SET_STRING(iovec[n++], "\n");
 
     (void)writev(log_target_fd, iovec, n);
+}
+
+/*
+ * Parse conversion specification starting at @p, just after the '%'.
+ * Returns pointer to the character after it.
+ */
+static const char *log_parse_spec(const char *p, struct log_spec *spec)
+{
+    unsigned int length = 0;
+    bool is_long_double = false;
+
+    spec->start = p - 1;
+    spec->n_stars = 0;
+    spec->type = LOG_ARG_INVALID;
+
+    while (*p && strchr("-+ #0'I", *p))
+        p++;
+
+    if (*p == '*') {
+        spec->n_stars++;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->n_stars++;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9')
+                p++;
+        }
+    }
+
+    /* length: 'h' and "hh" are promoted to int anyway */
+    for (;; p++) {
+        if (*p == 'h') {
+            continue;
+        } else if (*p == 'l') {
+            length++;
+        } else if (*p == 'q') {
+            length = 2;
+        } else if (*p == 'L') {
+            is_long_double = true;
+        } else if (*p == 'j') {
+            length = 'j';
+        } else if (*p == 'z' || *p == 'Z') {
+            length = 'z';
+        } else if (*p == 't') {
+            length = 't';
+        } else {
+            break;
+        }
+    }
+
+    spec->conversion = *p;
+
+    switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        if (length == 0)
+            spec->type = LOG_ARG_INT;
+        else if (length == 1)
+            spec->type = LOG_ARG_LONG;
+        else if (length == 2)
+            spec->type = LOG_ARG_LLONG;
+        else if (length == 'j')
+            spec->type = LOG_ARG_INTMAX;
+        else if (length == 'z')
+            spec->type = LOG_ARG_SIZE;
+        else if (length == 't')
+            spec->type = LOG_ARG_PTRDIFF;
+        break;
+    case 'c':
+        if (length == 0)
+            spec->type = LOG_ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        spec->type = is_long_double ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        break;
+    case 'p':
+        spec->type = LOG_ARG_PTR;
+        break;
+    case 's':
+        if (length == 0)
+            spec->type = LOG_ARG_STRING;
+        break;
+    case 'm':
+    case '%':
+        spec->type = LOG_ARG_NONE;
+        break;
+    }
+
+    /* wide chars/strings, %n and unknown conversions are not deferred */
+    if (*p)
+        p++;
+    spec->len = p - spec->start;
+
+    return p;
+}
+
+#define LOG_PUT(type, ap)                                               \
+    do {                                                                \
+        type _v = va_arg(ap, type);                                     \
+        if (end - args < (ptrdiff_t) sizeof(_v))                        \
+            return -ENOSPC;                                             \
+        memcpy(args, &_v, sizeof(_v));                                  \
+        args += sizeof(_v);                                             \
+    } while (0)
+
+/* Copy arguments of @format from @ap to @args. Returns the size used. */
+static int log_capture_args(const char *format, va_list ap, uint8_t *args, size_t size)
+{
+    uint8_t *const begin = args;
+    uint8_t *const end = args + size;
+    const char *p = format;
+    struct log_spec spec;
+    unsigned int i;
+
+    while ((p = strchr(p, '%'))) {
+        p = log_parse_spec(p + 1, &spec);
+
+        for (i = 0; i < spec.n_stars; i++)
+            LOG_PUT(int, ap);
+
+        switch (spec.type) {
+        case LOG_ARG_NONE:
+            break;
+        case LOG_ARG_INT:
+            LOG_PUT(int, ap);
+            break;
+        case LOG_ARG_LONG:
+            LOG_PUT(long, ap);
+            break;
+        case LOG_ARG_LLONG:
+            LOG_PUT(long long, ap);
+            break;
+        case LOG_ARG_INTMAX:
+            LOG_PUT(intmax_t, ap);
+            break;
+        case LOG_ARG_SIZE:
+            LOG_PUT(size_t, ap);
+            break;
+        case LOG_ARG_PTRDIFF:
+            LOG_PUT(ptrdiff_t, ap);
+            break;
+        case LOG_ARG_DOUBLE:
+            LOG_PUT(double, ap);
+            break;
+        case LOG_ARG_LDOUBLE:
+            LOG_PUT(long double, ap);
+            break;
+        case LOG_ARG_PTR:
+            LOG_PUT(void *, ap);
+            break;
+        case LOG_ARG_STRING: {
+            const char *str = va_arg(ap, const char *);
+            uint16_t len;
+
+            if (!str)
+                str = "(null)";
+            len = strnlen(str, LOG_STRING_ARG_MAX);
+
+            if (end - args < (ptrdiff_t) sizeof(len))
+                return -ENOSPC;
+            if ((size_t)(end - args) - sizeof(len) < len)
+                len = (end - args) - sizeof(len);
+
+            memcpy(args, &len, sizeof(len));
+            memcpy(args + sizeof(len), str, len);
+            args += sizeof(len) + len;
+            break;
+        }
+        case LOG_ARG_INVALID:
+            return -EINVAL;
+        }
+    }
+
+    return args - begin;
+}
+
+#undef LOG_PUT
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+
+#define LOG_GET(type)                                                   \
+    ({                                                                  \
+        type _v;                                                        \
+        memcpy(&_v, args, sizeof(_v));                                  \
+        args += sizeof(_v);                                             \
+        _v;                                                             \
+    })
+
+#define LOG_FORMAT(value)                                               \
+    (spec.n_stars == 0 ? snprintf(out, rem, fmt, value)                 \
+     : spec.n_stars == 1 ? snprintf(out, rem, fmt, stars[0], value)     \
+     : snprintf(out, rem, fmt, stars[0], stars[1], value))
+
+/* Format message from a record captured by log_capture_args() */
+static void log_format_record(const struct log_record *rec, char *out, size_t size)
+{
+    const uint8_t *args = rec->args;
+    const char *p = rec->format;
+    struct log_spec spec;
+    char fmt[32];
+    int stars[2];
+    unsigned int i;
+
+    while (*p && size > 1) {
+        const char *next = strchr(p, '%');
+        size_t rem = size;
+        int r = 0;
+
+        if (!next) {
+            snprintf(out, size, "%s", p);
+            return;
+        }
+
+        if (next != p) {
+            size_t len = next - p;
+
+            if (len >= size)
+                len = size - 1;
+            memcpy(out, p, len);
+            out += len;
+            size -= len;
+            p = next;
+            continue;
+        }
+
+        p = log_parse_spec(p + 1, &spec);
+        if (spec.len >= sizeof(fmt))
+            break;
+        memcpy(fmt, spec.start, spec.len);
+        fmt[spec.len] = '\0';
+
+        for (i = 0; i < spec.n_stars; i++)
+            stars[i] = LOG_GET(int);
+
+        switch (spec.type) {
+        case LOG_ARG_NONE:
+            /* %m must see the errno of the caller */
+            errno = rec->saved_errno;
+            r = spec.n_stars == 0 ? snprintf(out, rem, fmt)
+                : spec.n_stars == 1 ? snprintf(out, rem, fmt, stars[0])
+                : snprintf(out, rem, fmt, stars[0], stars[1]);
+            break;
+        case LOG_ARG_INT:
+            r = LOG_FORMAT(LOG_GET(int));
+            break;
+        case LOG_ARG_LONG:
+            r = LOG_FORMAT(LOG_GET(long));
+            break;
+        case LOG_ARG_LLONG:
+            r = LOG_FORMAT(LOG_GET(long long));
+            break;
+        case LOG_ARG_INTMAX:
+            r = LOG_FORMAT(LOG_GET(intmax_t));
+            break;
+        case LOG_ARG_SIZE:
+            r = LOG_FORMAT(LOG_GET(size_t));
+            break;
+        case LOG_ARG_PTRDIFF:
+            r = LOG_FORMAT(LOG_GET(ptrdiff_t));
+            break;
+        case LOG_ARG_DOUBLE:
+            r = LOG_FORMAT(LOG_GET(double));
+            break;
+        case LOG_ARG_LDOUBLE:
+            r = LOG_FORMAT(LOG_GET(long double));
+            break;
+        case LOG_ARG_PTR:
+            r = LOG_FORMAT(LOG_GET(void *));
+            break;
+        case LOG_ARG_STRING: {
+            char str[LOG_STRING_ARG_MAX + 1];
+            uint16_t len = LOG_GET(uint16_t);
+
+            memcpy(str, args, len);
+            str[len] = '\0';
+            args += len;
+            r = LOG_FORMAT(str);
+            break;
+        }
+        case LOG_ARG_INVALID:
+            /* can't happen: such messages are formatted by the caller */
+            return;
+        }
+
+        if (r < 0)
+            break;
+        if ((size_t) r >= size)
+            return;
+        out += r;
+        size -= r;
+    }
+
+    *out = '\0';
+}
+
+#undef LOG_FORMAT
+#undef LOG_GET
+
+#pragma GCC diagnostic pop
+
+static struct log_ring *log_get_thread_ring(void)
+{
+    struct log_ring *ring = log_thread_ring;
+
+    if (ring)
+        return ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    pthread_mutex_lock(&log_rings_lock);
+    ring->next = log_rings;
+    __atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log_rings_lock);
+
+    log_thread_ring = ring;
+
+    return ring;
+}
+
+static void log_ring_copy_in(struct log_ring *ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, (const uint8_t *)src + first, len - first);
+}
+
+static void log_ring_copy_out(const struct log_ring *ring, uint64_t pos, void *dst, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+
+    memcpy(dst, ring->data + off, first);
+    memcpy((uint8_t *)dst + first, ring->data, len - first);
+}
+
+static void log_writer_wake(void)
+{
+    const uint64_t one = 1;
+
+    /* pairs with the fence in log_writer_thread() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_writer_waiting, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&log_writer_waiting, false, __ATOMIC_RELAXED))
+        (void)write(log_writer_fd, &one, sizeof(one));
+}
+
+static int log_push(int level, int error, int saved_errno, const char *file, int line,
+                    const char *format, va_list ap)
+{
+    union {
+        struct log_record rec;
+        uint8_t buf[LOG_RECORD_MAX];
+    } u;
+    struct log_ring *ring;
+    uint64_t head, tail;
+    va_list aq;
+    int r;
+
+    ring = log_get_thread_ring();
+    if (!ring)
+        return -ENOMEM;
+
+    va_copy(aq, ap);
+    r = log_capture_args(format, aq, u.rec.args, sizeof(u) - sizeof(u.rec));
+    va_end(aq);
+    if (r < 0)
+        return r;
+
+    u.rec.size = sizeof(u.rec) + r;
+    u.rec.level = level;
+    u.rec.error = error;
+    u.rec.saved_errno = saved_errno;
+    u.rec.line = line;
+    u.rec.file = file;
+    u.rec.format = format;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (head - tail) < u.rec.size) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    log_ring_copy_in(ring, head, &u, u.rec.size);
+    __atomic_store_n(&ring->head, head + u.rec.size, __ATOMIC_RELEASE);
+
+    log_writer_wake();
+
+    return 0;
+}
+
+static unsigned int log_drain(void)
+{
+    struct log_ring *ring;
+    unsigned int n = 0;
+
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        uint32_t dropped;
+
+        while (tail < head) {
+            union {
+                struct log_record rec;
+                uint8_t buf[LOG_RECORD_MAX];
+            } u;
+            char msg[LINE_MAX];
+
+            log_ring_copy_out(ring, tail, &u.rec.size, sizeof(u.rec.size));
+            log_ring_copy_out(ring, tail, &u, u.rec.size);
+
+            log_format_record(&u.rec, msg, sizeof(msg));
+            log_write(u.rec.level, u.rec.file, u.rec.line, msg);
+
+            tail += u.rec.size;
+            n++;
+        }
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            char msg[64];
+
+            snprintf(msg, sizeof(msg), "%u log messages dropped", dropped);
+            log_write(LOG_WARNING, NULL, 0, msg);
+        }
+    }
+
+    return n;
+}
+
+static void *log_writer_thread(void *data)
+{
+    uint64_t n;
+
+    for (;;) {
+        /* check before draining so nothing logged before stop is lost */
+        bool stop = __atomic_load_n(&log_writer_stop, __ATOMIC_ACQUIRE);
+
+        if (log_drain() > 0)
+            continue;
+        if (stop)
+            break;
+
+        /*
+         * Announce we are going to sleep, then look at the rings again: a
+         * message pushed before the announcement was seen is drained now,
+         * one pushed after it wakes us up.
+         */
+        __atomic_store_n(&log_writer_waiting, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (log_drain() > 0 || __atomic_load_n(&log_writer_stop, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&log_writer_waiting, false, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        (void)read(log_writer_fd, &n, sizeof(n));
+    }
+
+    return NULL;
+}
+
+int log_open(void)
+{
+    sigset_t all, old;
+
+    if (isatty(log_target_fd))
+        log_show_colors = true;
+
+    /* signals are for the threads doing the actual work */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    log_writer_stop = false;
+    log_writer_waiting = false;
+    log_writer_fd = eventfd(0, EFD_CLOEXEC);
+    if (log_writer_fd >= 0) {
+        if (pthread_create(&log_writer, NULL, log_writer_thread, NULL) == 0) {
+            __atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+        } else {
+            close(log_writer_fd);
+            log_writer_fd = -1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!log_async) {
+        log_warning("Could not start log thread, logging synchronously");
+        return 0;
+    }
+
+    /*
+     * Ring of the calling thread now rather than on its first message, which
+     * may come after allocations are forbidden in static footprint mode
+     */
+    log_get_thread_ring();
+
+    return 0;
+}
+
+/* Must be called after other threads stopped logging */
+int log_close(void)
+{
+    if (!log_async)
+        return 0;
+
+    __atomic_store_n(&log_async, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_writer_stop, true, __ATOMIC_RELEASE);
+    log_writer_wake();
+    pthread_join(log_writer, NULL);
+
+    close(log_writer_fd);
+    log_writer_fd = -1;
+
+    return 0;
+}
+
+static int log_internalv(int level, int error,
+                         const char *file, int line,
+                         const char *format, va_list ap)
+{
+    char buffer[LINE_MAX];
+    int save_errno;
+
+    assert((level & LOG_PRIMASK) == level);
+
+    /* so %m works as expected */
+    save_errno = errno;
+
+    if (level >= LOG_NOTICE && __atomic_load_n(&log_async, __ATOMIC_ACQUIRE)
+        && log_push(level, error, save_errno, file, line, format, ap) == 0) {
+        errno = save_errno;
+        return -abs(error);
+    }
+
+    errno = save_errno;
+    vsnprintf(buffer, sizeof(buffer), format, ap);
+
+    log_write(level, file, line, buffer);
 
     return -abs(error);
 }
@@ -28,19 +28,46 @@
 extern "C" {
 #endif
 
-int log_open(void);
-int log_close(void);
+/*
+ * Messages less important than this are compiled out, e.g. build with
+ * -DLOG_MAX_COMPILED_LEVEL=LOG_INFO to remove all debug messages
+ */
+#ifndef LOG_MAX_COMPILED_LEVEL
+#define LOG_MAX_COMPILED_LEVEL LOG_DEBUG
+#endif
+
+/*
+ * After log_open() messages from LOG_NOTICE to LOG_DEBUG are not written by
+ * the caller: the format and a binary copy of the arguments are put on a
+ * per-thread ring and formatted/written by a background thread, so logging
+ * from the routing path never blocks on the log target. If the ring is
+ * full, messages are dropped and the number of dropped messages is logged
+ * later. More important messages are still written synchronously, so they
+ * may show up before less important ones logged just before them. The ring
+ * of the thread calling log_open() is allocated right away, other threads
+ * get theirs on their first message.
+ */
+_public_ int log_open(void);
+_public_ int log_close(void);
+
+/* Don't use directly, it's only here so the check below can be inlined */
+_public_ extern int _log_max_level;
+
+static inline int log_get_max_level(void)
+{
+    return _log_max_level;
+}
 
-int log_get_max_level(void) _pure_;
-void log_set_max_level(int level);
-int log_internal(int level, int error,
-                 const char *file, int line,
-                 const char *format, ...) _printf_format_(5, 6);
+_public_ void log_set_max_level(int level);
+_public_ int log_internal(int level, int error,
+                          const char *file, int line,
+                          const char *format, ...) _printf_format_(5, 6);
 
 #define log_full_errno(level, error, ...)                               \
     ({                                                                  \
          int _level = (level), _e = (error);                            \
-         (log_get_max_level() >= LOG_PRI(_level))                       \
+         (LOG_PRI(_level) <= LOG_MAX_COMPILED_LEVEL                     \
+          && _log_max_level >= LOG_PRI(_level))                         \
             ? log_internal(_level, _e, __FILE__, __LINE__, __VA_ARGS__) \
             : -abs(_e);                                                 \
         })
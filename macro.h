@@ -24,6 +24,8 @@
 #define _cleanup_(x) __attribute__((cleanup(x)))
 #define _pure_ __attribute__((pure))
 #define _packed_ __attribute__((packed))
+/* Exported from libmavlink-router, everything else is hidden */
+#define _public_ __attribute__((visibility("default")))
 
 #define IOVEC_SET_STRING(i, s)          \
     do {                                \
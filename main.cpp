@@ -20,64 +20,170 @@
 #include <errno.h>
 #include <getopt.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "comm.h"
+#include "conflate.h"
 #include "log.h"
+#include "mainloop.h"
 #include "util.h"
 
-class Mainloop {
-public:
-    int open();
-    int add_fd(int fd, void *data, int events);
-    int mod_fd(int fd, void *data, int events);
-    void loop();
-    void handle_read(Endpoint *e);
-    void handle_canwrite(Endpoint *e);
-    void write_msg(Endpoint *e, const struct buffer *buf);
-
-    int epollfd = -1;
-    bool report_msg_statistics = false;
-};
-
 struct endpoint_address {
     struct endpoint_address *next;
     const char *ip;
     unsigned long port;
+    int mcast_ttl;
+    bool mcast_loop;
+    bool ingress;
+    unsigned long shards;
+    bool monitor;
+    unsigned long sample_rate;
+    unsigned long liveness_timeout_ms;
+    unsigned long probe_interval_ms;
+    unsigned long batch_size;
+    unsigned long batch_delay_ms;
+    bool conflate;
+    bool router;
 };
 
 static struct opt {
     long unsigned baudrate;
     struct endpoint_address *ep_addrs;
     bool report_msg_statistics;
+    bool cache;
+    bool coalesce_commands;
+    unsigned long busy_poll_us;
+    int cpu;
+    int rt_priority;
+    unsigned long latency_budget_ms;
+    const char *unix_path;
+    bool unix_conflate;
+    const char *blackbox_path;
+    unsigned long blackbox_size_kb;
+    const char *capture_path;
+    char *replay_path;
+    double replay_speed;
+    int replay_source;
+    int replay_msgid;
+    unsigned long replay_seek_s;
 } opt = {
     .baudrate = 115200U,
     .ep_addrs = nullptr,
     .report_msg_statistics = false,
+    .cache = false,
+    .coalesce_commands = false,
+    .busy_poll_us = 0,
+    .cpu = -1,
+    .rt_priority = 0,
+    .latency_budget_ms = 0,
+    .unix_path = nullptr,
+    .unix_conflate = false,
+    .blackbox_path = nullptr,
+    .blackbox_size_kb = 4096,
+    .capture_path = nullptr,
+    .replay_path = nullptr,
+    .replay_speed = 1,
+    .replay_source = 0,
+    .replay_msgid = -1,
+    .replay_seek_s = 0,
 };
 
-static Endpoint *g_master;
-static Endpoint **g_endpoints;
-static volatile bool g_should_exit;
+static Mainloop *g_mainloop;
 
 static void help(FILE *fp) {
     fprintf(fp,
-            "%s [OPTIONS...] <uart>\n\n"
+            "%s [OPTIONS...] <uart>\n"
+            "%s [OPTIONS...] --replay <capture>\n\n"
             "  -h --help                    Print this message\n"
             "  -b --baudrate                Use baudrate for UART\n"
             "  -e --endpoint <ip[:port]>    Add UDP endpoint to communicate port is optional\n"
             "                               and in case it's not given it starts in 14550 and\n"
             "                               continues increasing not to collide with previous\n"
-            "                               ports\n"
-            "  -r --report_msg_statistics   Report message statistics\n"
-            , program_invocation_short_name);
+            "                               ports. IPv6 addresses are given inside brackets,\n"
+            "                               e.g. [::1]:14550. Comma-separated options may\n"
+            "                               follow the address:\n"
+            "                                 ttl=<hops>  TTL of multicast packets (default 1)\n"
+            "                                 loop        Loop multicast packets back to this host\n"
+            "                                 bind        Listen on ip:port instead of sending to it\n"
+            "                                             and reply to the last sender\n"
+            "                                 shards=<n>  With bind, spread the kernel receive load\n"
+            "                                             over n sockets sharing the port, steered\n"
+            "                                             by sysid. Routing stays single-threaded\n"
+            "                                 monitor     Eavesdrop: get a copy of all the traffic\n"
+            "                                             without backpressure, dropping packets if\n"
+            "                                             the consumer is slow; nothing is routed\n"
+            "                                             from it\n"
+            "                                 sample=<n>  With monitor, only get 1 in n packets\n"
+            "                                 timeout=<ms>\n"
+            "                                             Stop sending to the endpoint if nothing\n"
+            "                                             is received from it for this long, except\n"
+            "                                             for probes. Resume when it's heard again\n"
+            "                                 probe=<ms>  Interval between probes (default 1000)\n"
+            "                                 batch=<bytes>\n"
+            "                                             Pack several packets in each datagram of up\n"
+            "                                             to this size, e.g. the path MTU, to save\n"
+            "                                             headers on metered links\n"
+            "                                 delay=<ms>  With batch, maximum time a packet waits for\n"
+            "                                             others to be sent along (default 10)\n"
+            "                                 conflate    If the consumer falls behind, queue packets\n"
+            "                                             keeping only the latest of each state message\n"
+            "                                             (ATTITUDE, SYS_STATUS...) per vehicle. Only\n"
+            "                                             when our send buffer fills: a slow receiver\n"
+            "                                             still drops datagrams on its side\n"
+            "                                 router      The endpoint is another router: drop\n"
+            "                                             packets that come back through it after\n"
+            "                                             going around a loop, and never send it\n"
+            "                                             back what it sent\n"
+            "  -u --unix <path>[,conflate]  Listen for local clients on an AF_UNIX\n"
+            "                               SOCK_SEQPACKET socket. With conflate, clients\n"
+            "                               that fall behind get queued packets conflated\n"
+            "                               as with the endpoint option\n"
+            "  -c --cache                   Cache parameters and mission of the vehicle and\n"
+            "                               answer requests for them without going through\n"
+            "                               the UART\n"
+            "  -m --coalesce-commands       Send the vehicle only one of the identical\n"
+            "                               COMMAND_LONGs sent by several GCSes or retried\n"
+            "                               while one is in flight, and give each sender\n"
+            "                               the COMMAND_ACK\n"
+            "  -B --busy-poll <us>          Keep polling for this long after each packet\n"
+            "                               instead of sleeping, to cut wakeup latency\n"
+            "  -C --cpu <n>                 Pin the routing thread to CPU n\n"
+            "  -R --realtime <priority>     Run the routing thread with SCHED_FIFO at this\n"
+            "                               priority and lock memory\n"
+            "  -L --latency-budget <ms>     Save power: let input accumulate for up to this\n"
+            "                               long and handle it in batches, waking up less\n"
+            "  -k --blackbox <path>         Record the latest packets in a ring backed by\n"
+            "                               this file, better on tmpfs: a name without\n"
+            "                               directory is put in " BLACKBOX_DEFAULT_DIR ".\n"
+            "                               SIGUSR1 dumps them to a new file next to it, as\n"
+            "                               do a crash and COMMAND_LONG MAV_CMD_USER_1 with\n"
+            "                               param1 = 1 sent to MAV_COMP_ID_LOG\n"
+            "  -K --blackbox-size <KiB>     Size of the blackbox ring (default 4096). As much\n"
+            "                               again is used for a copy to dump from\n"
+            "  -w --capture <path>          Capture all the packets routed to this file\n"
+            "  -P --replay <capture>        Replay a capture in place of the UART.\n"
+            "                               Comma-separated options may follow the path:\n"
+            "                                 speed=<x>   Speed factor, or max to replay as\n"
+            "                                             fast as possible (default 1)\n"
+            "                                 from=<id>   Only packets captured from this\n"
+            "                                             endpoint id, or all (default 0, the\n"
+            "                                             UART)\n"
+            "                                 msgid=<id>  Only packets with this msgid\n"
+            "                                 seek=<s>    Start this many seconds into the\n"
+            "                                             capture\n"
+            "  -r --report_msg_statistics   Report message statistics every second\n"
+            "  -v --verbose                 Verbose, also log debug messages\n"
+            , program_invocation_short_name, program_invocation_short_name);
 }
 
 static unsigned long find_next_endpoint_port(const char *ip)
@@ -100,12 +206,235 @@ static unsigned long find_next_endpoint_port(const char *ip)
     return port;
 }
 
+static int parse_endpoint_options(struct endpoint_address *e, char *options)
+{
+    char *saveptr = NULL;
+
+    for (char *o = strtok_r(options, ",", &saveptr); o; o = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(o, '=');
+        if (value)
+            *value++ = '\0';
+
+        if (streq(o, "loop") && !value) {
+            e->mcast_loop = true;
+        } else if (streq(o, "bind") && !value) {
+            e->ingress = true;
+        } else if (streq(o, "conflate") && !value) {
+            e->conflate = true;
+        } else if (streq(o, "router") && !value) {
+            e->router = true;
+        } else if (streq(o, "monitor") && !value) {
+            e->monitor = true;
+        } else if (streq(o, "sample") && value) {
+            if (safe_atoul(value, &e->sample_rate) < 0 || e->sample_rate == 0) {
+                log_error("Invalid sample rate: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "timeout") && value) {
+            if (safe_atoul(value, &e->liveness_timeout_ms) < 0) {
+                log_error("Invalid timeout: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "probe") && value) {
+            if (safe_atoul(value, &e->probe_interval_ms) < 0 || e->probe_interval_ms == 0) {
+                log_error("Invalid probe interval: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "batch") && value) {
+            if (safe_atoul(value, &e->batch_size) < 0 || e->batch_size == 0) {
+                log_error("Invalid batch size: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "delay") && value) {
+            if (safe_atoul(value, &e->batch_delay_ms) < 0) {
+                log_error("Invalid batch delay: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "shards") && value) {
+            if (safe_atoul(value, &e->shards) < 0 || e->shards == 0 || e->shards > 64) {
+                log_error("Invalid number of shards: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "ttl") && value) {
+            if (safe_atoi(value, &e->mcast_ttl) < 0 || e->mcast_ttl < 0 || e->mcast_ttl > 255) {
+                log_error("Invalid multicast TTL: %s", value);
+                return -EINVAL;
+            }
+        } else {
+            log_error("Invalid endpoint option: %s", o);
+            return -EINVAL;
+        }
+    }
+
+    if (e->shards > 1 && !e->ingress) {
+        log_error("Endpoint option shards requires bind");
+        return -EINVAL;
+    }
+
+    if (e->monitor && e->ingress) {
+        log_error("Monitor endpoints can't be used with bind");
+        return -EINVAL;
+    }
+
+    if (e->batch_size && e->monitor) {
+        log_error("Monitor endpoints can't be used with batch");
+        return -EINVAL;
+    }
+
+    if (e->conflate && (e->monitor || e->batch_size)) {
+        log_error("Endpoint option conflate can't be used with monitor or batch");
+        return -EINVAL;
+    }
+
+    if (e->router && e->monitor) {
+        log_error("Monitor endpoints can't be used with router");
+        return -EINVAL;
+    }
+
+    if (e->sample_rate > 1 && !e->monitor) {
+        log_error("Endpoint option sample requires monitor");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int parse_replay(const char *arg)
+{
+    char *saveptr = NULL;
+    char *options;
+
+    opt.replay_path = strdup(arg);
+    options = strchr(opt.replay_path, ',');
+    if (!options)
+        return 0;
+    *options++ = '\0';
+
+    for (char *o = strtok_r(options, ",", &saveptr); o; o = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(o, '=');
+        if (value)
+            *value++ = '\0';
+
+        if (streq(o, "speed") && value) {
+            char *end;
+
+            if (streq(value, "max")) {
+                opt.replay_speed = 0;
+                continue;
+            }
+            opt.replay_speed = strtod(value, &end);
+            if (*end || !(opt.replay_speed > 0)) {
+                log_error("Invalid replay speed: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "from") && value) {
+            if (streq(value, "all")) {
+                opt.replay_source = -1;
+            } else if (safe_atoi(value, &opt.replay_source) < 0 || opt.replay_source < 0
+                       || opt.replay_source > UINT8_MAX) {
+                log_error("Invalid replay source: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "msgid") && value) {
+            if (safe_atoi(value, &opt.replay_msgid) < 0 || opt.replay_msgid < 0) {
+                log_error("Invalid replay msgid: %s", value);
+                return -EINVAL;
+            }
+        } else if (streq(o, "seek") && value) {
+            if (safe_atoul(value, &opt.replay_seek_s) < 0) {
+                log_error("Invalid replay seek: %s", value);
+                return -EINVAL;
+            }
+        } else {
+            log_error("Invalid replay option: %s", o);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int parse_endpoint(const char *arg)
+{
+    char *ip = strdup(arg);
+    char *portstr, *options;
+    unsigned long port;
+
+    options = strchr(ip, ',');
+    if (options)
+        *options++ = '\0';
+
+    if (ip[0] == '[') {
+        /* IPv6 address: [addr]:port */
+        char *end = strchr(ip, ']');
+        if (!end || (end[1] != '\0' && end[1] != ':')) {
+            log_error("Invalid IPv6 address in argument: %s", arg);
+            free(ip);
+            return -EINVAL;
+        }
+
+        /* drop the brackets so we are left with "addr:port" */
+        size_t addrlen = end - ip - 1;
+        memmove(ip, ip + 1, addrlen);
+        memmove(ip + addrlen, end + 1, strlen(end + 1) + 1);
+        portstr = ip + addrlen;
+    } else {
+        portstr = strchrnul(ip, ':');
+    }
+
+    if (*portstr == '\0') {
+        port = find_next_endpoint_port(ip);
+    } else {
+        *portstr = '\0';
+        if (safe_atoul(portstr + 1, &port) < 0) {
+            log_error("Invalid port in argument: %s", arg);
+            free(ip);
+            return -EINVAL;
+        }
+    }
+
+    struct endpoint_address *e = (struct endpoint_address*) calloc(1, sizeof(*e));
+    e->ip = ip;
+    e->port = port;
+    e->mcast_ttl = 1;
+    e->shards = 1;
+    e->sample_rate = 1;
+    e->probe_interval_ms = 1000;
+    e->batch_delay_ms = 10;
+
+    if (options && parse_endpoint_options(e, options) < 0) {
+        free(ip);
+        free(e);
+        return -EINVAL;
+    }
+
+    e->next = opt.ep_addrs;
+    opt.ep_addrs = e;
+
+    return 0;
+}
+
+/* -k with a name instead of a path */
+static char blackbox_path[PATH_MAX];
+
 static int parse_argv(int argc, char *argv[], const char **uart)
 {
     static const struct option options[] = {
         { "baudrate",               required_argument,  NULL,   'b' },
         { "endpoints",              required_argument,  NULL,   'e' },
+        { "unix",                   required_argument,  NULL,   'u' },
+        { "cache",                  no_argument,        NULL,   'c' },
+        { "coalesce-commands",      no_argument,        NULL,   'm' },
+        { "busy-poll",              required_argument,  NULL,   'B' },
+        { "cpu",                    required_argument,  NULL,   'C' },
+        { "realtime",               required_argument,  NULL,   'R' },
+        { "latency-budget",         required_argument,  NULL,   'L' },
+        { "blackbox",               required_argument,  NULL,   'k' },
+        { "blackbox-size",          required_argument,  NULL,   'K' },
+        { "capture",                required_argument,  NULL,   'w' },
+        { "replay",                 required_argument,  NULL,   'P' },
         { "report_msg_statistics",  no_argument,        NULL,   'r' },
+        { "verbose",                no_argument,        NULL,   'v' },
         { }
     };
     int c;
@@ -114,7 +443,7 @@ static int parse_argv(int argc, char *argv[], const char **uart)
     assert(argv);
     assert(uart);
 
-    while ((c = getopt_long(argc, argv, "hb:e:r", options, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "hb:e:u:cmB:C:R:L:k:K:w:P:rv", options, NULL)) >= 0) {
         switch (c) {
         case 'h':
             help(stdout);
@@ -127,33 +456,97 @@ static int parse_argv(int argc, char *argv[], const char **uart)
             }
             break;
         case 'e': {
-            char *ip = strdup(optarg);
-
-            char *portstr = strchrnul(ip, ':');
-            unsigned long port;
-            if (*portstr == '\0') {
-                port = find_next_endpoint_port(ip);
-            } else {
-                *portstr = '\0';
-                if (safe_atoul(portstr + 1, &port) < 0) {
-                    log_error("Invalid port in argument: %s", optarg);
-                    free(ip);
+            int r = parse_endpoint(optarg);
+            if (r < 0) {
+                help(stderr);
+                return r;
+            }
+            break;
+        }
+        case 'c': {
+            opt.cache = true;
+            break;
+        }
+        case 'm':
+            opt.coalesce_commands = true;
+            break;
+        case 'u': {
+            char *unix_options = strchr(optarg, ',');
+
+            opt.unix_path = optarg;
+            if (unix_options) {
+                *unix_options++ = '\0';
+                if (!streq(unix_options, "conflate")) {
+                    log_error("Invalid unix socket option: %s", unix_options);
                     help(stderr);
                     return -EINVAL;
                 }
+                opt.unix_conflate = true;
             }
-
-            struct endpoint_address *e = (struct endpoint_address*) malloc(sizeof(*e));
-            e->next = opt.ep_addrs;
-            e->ip = ip;
-            e->port = port;
-            opt.ep_addrs = e;
             break;
         }
+        case 'B':
+            if (safe_atoul(optarg, &opt.busy_poll_us) < 0) {
+                log_error("Invalid argument for busy-poll = %s", optarg);
+                help(stderr);
+                return -EINVAL;
+            }
+            break;
+        case 'C':
+            if (safe_atoi(optarg, &opt.cpu) < 0 || opt.cpu < 0 || opt.cpu >= CPU_SETSIZE) {
+                log_error("Invalid argument for cpu = %s", optarg);
+                help(stderr);
+                return -EINVAL;
+            }
+            break;
+        case 'R':
+            if (safe_atoi(optarg, &opt.rt_priority) < 0
+                || opt.rt_priority < sched_get_priority_min(SCHED_FIFO)
+                || opt.rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+                log_error("Invalid argument for realtime = %s", optarg);
+                help(stderr);
+                return -EINVAL;
+            }
+            break;
+        case 'L':
+            if (safe_atoul(optarg, &opt.latency_budget_ms) < 0) {
+                log_error("Invalid argument for latency-budget = %s", optarg);
+                help(stderr);
+                return -EINVAL;
+            }
+            break;
+        case 'k':
+            if (strchr(optarg, '/')) {
+                opt.blackbox_path = optarg;
+                break;
+            }
+            snprintf(blackbox_path, sizeof(blackbox_path), BLACKBOX_DEFAULT_DIR "/%s", optarg);
+            opt.blackbox_path = blackbox_path;
+            break;
+        case 'K':
+            if (safe_atoul(optarg, &opt.blackbox_size_kb) < 0 || opt.blackbox_size_kb == 0) {
+                log_error("Invalid argument for blackbox-size = %s", optarg);
+                help(stderr);
+                return -EINVAL;
+            }
+            break;
+        case 'w':
+            opt.capture_path = optarg;
+            break;
+        case 'P':
+            if (parse_replay(optarg) < 0) {
+                help(stderr);
+                return -EINVAL;
+            }
+            break;
         case 'r': {
             opt.report_msg_statistics = true;
             break;
         }
+        case 'v': {
+            log_set_max_level(LOG_DEBUG);
+            break;
+        }
         case '?':
         default:
             help(stderr);
@@ -161,8 +554,17 @@ static int parse_argv(int argc, char *argv[], const char **uart)
         }
     }
 
-    /* positional arguments */
-    if (optind + 1 != argc) {
+    if (opt.busy_poll_us && opt.latency_budget_ms) {
+        log_error("busy-poll and latency-budget can't be used together");
+        help(stderr);
+        return -EINVAL;
+    }
+
+    /* positional arguments: the UART is replaced by the capture on replay */
+    if (opt.replay_path && optind == argc)
+        return 2;
+
+    if (optind + 1 != argc || opt.replay_path) {
         log_error("Error parsing required argument %d %d", optind, argc);
         help(stderr);
         return -EINVAL;
@@ -173,157 +575,168 @@ static int parse_argv(int argc, char *argv[], const char **uart)
     return 2;
 }
 
-int Mainloop::open()
+static void exit_signal_handler(int signum)
 {
-    if (epollfd != -1)
-        return -EBUSY;
-
-    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    g_mainloop->request_exit();
+}
 
-    if (epollfd == -1) {
-        log_error_errno(errno, "%m");
-        return -1;
-    }
+static void blackbox_signal_handler(int signum)
+{
+    g_mainloop->request_blackbox_dump();
+}
 
-    return 0;
+/* Save the blackbox, then let the default action kill us */
+static void crash_signal_handler(int signum)
+{
+    g_mainloop->dump_blackbox_on_crash();
+    raise(signum);
 }
 
-int Mainloop::mod_fd(int fd, void *data, int events)
+static void setup_signal_handlers()
 {
-    struct epoll_event epev = { };
+    struct sigaction sa = { };
 
-    epev.events = events;
-    epev.data.ptr = data;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = exit_signal_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
-    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &epev) < 0) {
-        log_error_errno(errno, "Could not mod fd (%m)");
-        return -1;
-    }
+    sa.sa_handler = blackbox_signal_handler;
+    sigaction(SIGUSR1, &sa, NULL);
 
-    return 0;
+    sa.sa_flags = SA_RESETHAND;
+    sa.sa_handler = crash_signal_handler;
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+    sigaction(SIGILL, &sa, NULL);
+    sigaction(SIGFPE, &sa, NULL);
+    sigaction(SIGABRT, &sa, NULL);
 }
 
-int Mainloop::add_fd(int fd, void *data, int events)
+/*
+ * Affinity and scheduling policy are per thread: only the routing thread is
+ * affected, the log writer started before keeps running anywhere.
+ */
+static int setup_realtime()
 {
-    struct epoll_event epev = { };
-
-    epev.events = events;
-    epev.data.ptr = data;
-
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
-        log_error_errno(errno, "Could not add fd to epoll (%m)");
-        return -1;
+    if (opt.cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(opt.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            log_error_errno(errno, "Could not pin to CPU %d (%m)", opt.cpu);
+            return -1;
+        }
     }
 
-    return 0;
-}
+    if (opt.rt_priority) {
+        struct sched_param sp = { };
 
-void Mainloop::write_msg(Endpoint *e, const struct buffer *buf)
-{
-    int r = e->write_msg(buf);
-
-    /*
-     * If endpoint would block, add EPOLLOUT event to get notified when it's
-     * possible to write again
-     */
-    if (r == -EAGAIN)
-        mod_fd(e->fd, e, EPOLLIN | EPOLLOUT);
-}
+        sp.sched_priority = opt.rt_priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+            log_error_errno(errno, "Could not set realtime priority (%m)");
+            return -1;
+        }
 
-void Mainloop::handle_read(Endpoint *endpoint)
-{
-    assert(endpoint);
-
-    struct buffer buf{};
-
-    /*
-     * We read from this endpoint and forward to the other endpoints.
-     * Currently this makes the flight stack endpoint (master) as a special
-     * one: packets from master goes to the other connected endpoints and
-     * packets from endpoints go to master.
-     *
-     * This logic should be replaced with a routing logic so each endpoint
-     * can talk to each one without involving the flight stack.
-     */
-    while (endpoint->read_msg(&buf) > 0) {
-        if (endpoint == g_master) {
-            for (Endpoint **e = g_endpoints; *e != nullptr; e++) {
-                write_msg(*e, &buf);
-            }
-        } else {
-            write_msg(g_master, &buf);
+        /* Don't take page faults in the routing path */
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            log_error_errno(errno, "Could not lock memory (%m)");
+            return -1;
         }
     }
-}
 
-void Mainloop::handle_canwrite(Endpoint *e)
-{
-    int r = e->flush_pending_msgs();
-
-    /*
-     * If we could flush everything without triggering another block write,
-     * remove EPOLLOUT from flags so we don't get called again
-     */
-    if (r != -EAGAIN)
-        mod_fd(e->fd, e, EPOLLIN);
+    return 0;
 }
 
-void Mainloop::loop()
+static int add_master(Mainloop &mainloop, const char *uartstr)
 {
-    const int max_events = 8;
-    struct epoll_event events[max_events];
-    int r;
+    if (opt.replay_path) {
+        ReplayEndpoint *replay = new ReplayEndpoint{mainloop};
 
-    if (epollfd < 0)
-        return;
+        if (replay->open(opt.replay_path) < 0)
+            goto fail_replay;
 
-    while (!g_should_exit) {
-        int i;
+        /* Before adding it, so its first flush is scheduled */
+        replay->set_source(opt.replay_source);
+        replay->set_msgid(opt.replay_msgid);
+        replay->set_speed(opt.replay_speed);
+        replay->seek(replay->start_timestamp() + opt.replay_seek_s * NSEC_PER_SEC);
 
-        r = epoll_wait(epollfd, events, max_events, -1);
-        if (r < 0 && errno == EINTR)
-            continue;
-
-        for (i = 0; i < r; i++) {
-            Endpoint *e = static_cast<Endpoint*>(events[i].data.ptr);
+        if (mainloop.add_endpoint(replay, true) < 0)
+            goto fail_replay;
 
-            if (events[i].events & EPOLLIN)
-                handle_read(e);
+        return 0;
 
-            if (events[i].events & EPOLLOUT)
-                handle_canwrite(e);
-        }
+fail_replay:
+        delete replay;
+        return -1;
+    }
 
-        if (report_msg_statistics) {
-            g_master->print_statistics();
-            for (Endpoint **e = g_endpoints; *e != nullptr; e++) {
-                (*e)->print_statistics();
-            }
-        }
+    UartEndpoint *uart = new UartEndpoint{};
+    if (uart->open(uartstr, opt.baudrate) < 0 || mainloop.add_endpoint(uart, true) < 0) {
+        delete uart;
+        return -1;
     }
+
+    return 0;
 }
 
-static void exit_signal_handler(int signum)
+#ifdef STATIC_FOOTPRINT
+/* Libraries, logging and the like, for what is allocated before endpoints */
+#define BASE_FOOTPRINT (256U * 1024U)
+
+/* Memory the configuration needs, to size the arena */
+static size_t footprint()
 {
-    g_should_exit = true;
+    unsigned int n_endpoints = 1;
+    size_t size = BASE_FOOTPRINT;
+    bool mesh = false;
+
+    for (struct endpoint_address *e = opt.ep_addrs; e; e = e->next) {
+        n_endpoints += e->shards;
+        if (e->conflate)
+            size += ConflatingQueue::footprint();
+        mesh = mesh || e->router;
+    }
+
+    if (mesh)
+        size += MeshFilter::footprint();
+    if (opt.coalesce_commands)
+        size += sizeof(CommandCoalescer);
+
+    size += n_endpoints * (Endpoint::footprint(n_endpoints) + n_endpoints * sizeof(Endpoint *));
+
+    if (opt.replay_path)
+        size += ReplayEndpoint::footprint(opt.replay_path);
+    if (opt.capture_path)
+        size += sizeof(Capture) + CAPTURE_BLOCK_SIZE;
+    if (opt.blackbox_path)
+        size += sizeof(BlackBox) + strlen(opt.blackbox_path) + opt.blackbox_size_kb * 1024;
+
+    return size;
 }
 
-static void setup_signal_handlers()
+/*
+ * Everything is allocated: also get out of the way what libc allocates on
+ * first use, then forbid allocations
+ */
+static char stdout_buf[BUFSIZ];
+
+static void seal_footprint(Mainloop &mainloop)
 {
-    struct sigaction sa = { };
+    mainloop.preallocate();
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+    tzset();
 
-    sa.sa_flags = SA_NOCLDSTOP;
-    sa.sa_handler = exit_signal_handler;
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGINT, &sa, NULL);
+    arena_set_sealed(true);
+
+    log_info("Static footprint: %zu of %zu bytes of arena used", arena_used(), arena_size());
 }
+#endif
 
-static void free_endpoints()
+static void free_endpoint_addresses()
 {
-    for (Endpoint **e = g_endpoints; *e; e++) {
-        delete *e;
-    }
-
     for (auto e = opt.ep_addrs; e;) {
         auto next = e->next;
         free(e);
@@ -333,23 +746,69 @@ static void free_endpoints()
 
 static bool add_endpoints(Mainloop &mainloop)
 {
-    unsigned n_endpoints = 0, i = 0;
-    struct endpoint_address *e;
+    for (struct endpoint_address *e = opt.ep_addrs; e; e = e->next) {
+        if (e->monitor) {
+            MonitorEndpoint *monitor = new MonitorEndpoint{(unsigned int) e->sample_rate};
+
+            if (monitor->open(e->ip, e->port, e->mcast_ttl, e->mcast_loop) < 0) {
+                log_error("Could not open %s:%ld", e->ip, e->port);
+                delete monitor;
+                return false;
+            }
+
+            if (mainloop.add_monitor(monitor) < 0) {
+                delete monitor;
+                return false;
+            }
+            continue;
+        }
 
-    for (e = opt.ep_addrs; e; e = e->next)
-        n_endpoints++;
+        for (unsigned int shard = 0; shard < e->shards; shard++) {
+            UdpEndpoint *udp = new UdpEndpoint{};
+            int r;
+
+            if (e->ingress)
+                r = udp->open_ingress(e->ip, e->port, shard, e->shards);
+            else
+                r = udp->open(e->ip, e->port, e->mcast_ttl, e->mcast_loop);
+            if (r < 0) {
+                log_error("Could not open %s:%ld", e->ip, e->port);
+                delete udp;
+                return false;
+            }
 
-    g_endpoints = (Endpoint**) calloc(n_endpoints + 1, sizeof(Endpoint*));
+            if (e->liveness_timeout_ms)
+                udp->set_liveness(e->liveness_timeout_ms * USEC_PER_MSEC,
+                                  e->probe_interval_ms * USEC_PER_MSEC);
 
-    for (e = opt.ep_addrs; e; e = e->next) {
-        UdpEndpoint *udp = new UdpEndpoint{};
-        if (udp->open(e->ip, e->port) < 0) {
-            log_error("Could not open %s:%ld", e->ip, e->port);
-            return false;
-        }
+            if (e->conflate)
+                udp->enable_conflation();
+
+            if (e->router) {
+                r = mainloop.enable_mesh();
+                if (r < 0 && r != -EBUSY) {
+                    delete udp;
+                    return false;
+                }
+                udp->router_link = true;
+            }
 
-        g_endpoints[i++] = udp;
-        mainloop.add_fd(udp->fd, udp, EPOLLIN);
+            /* Not fatal, we still poll on our side */
+            if (opt.busy_poll_us)
+                udp->set_busy_poll(opt.busy_poll_us);
+
+            if (e->batch_size
+                && udp->set_batching(e->batch_size, e->batch_delay_ms * USEC_PER_MSEC) < 0) {
+                log_error("Invalid batch size %lu for %s:%ld", e->batch_size, e->ip, e->port);
+                delete udp;
+                return false;
+            }
+
+            if (mainloop.add_endpoint(udp) < 0) {
+                delete udp;
+                return false;
+            }
+        }
     }
 
     return true;
@@ -358,9 +817,10 @@ static bool add_endpoints(Mainloop &mainloop)
 int main(int argc, char *argv[])
 {
     const char *uartstr = NULL;
-    UartEndpoint uart{};
     Mainloop mainloop{};
+    int ret = EXIT_FAILURE;
 
+    g_mainloop = &mainloop;
     setup_signal_handlers();
 
     log_open();
@@ -368,29 +828,66 @@ int main(int argc, char *argv[])
     if (parse_argv(argc, argv, &uartstr) != 2)
         goto close_log;
 
-    if (mainloop.open() < 0)
+#ifdef STATIC_FOOTPRINT
+    if (opt.unix_path || opt.cache) {
+        log_error("--unix and --cache allocate memory at runtime: not available with a static "
+                  "footprint");
+        goto close_log;
+    }
+
+    if (arena_init(footprint()) < 0)
         goto close_log;
+#endif
 
-    if (uart.open(uartstr, opt.baudrate) < 0)
+    if (mainloop.open() < 0)
         goto close_log;
 
-    g_master = &uart;
-    mainloop.add_fd(uart.fd, &uart, EPOLLIN);
+    if (add_master(mainloop, uartstr) < 0)
+        goto close_log;
 
     if (!add_endpoints(mainloop))
         goto close_log;
 
+    if (opt.unix_path && mainloop.add_unix_listener(opt.unix_path, opt.unix_conflate) < 0)
+        goto close_log;
+
+    if (opt.cache && mainloop.enable_cache() < 0)
+        goto close_log;
+
+    if (opt.coalesce_commands && mainloop.enable_command_coalescing() < 0)
+        goto close_log;
+
+    if (opt.blackbox_path
+        && mainloop.enable_blackbox(opt.blackbox_path, opt.blackbox_size_kb * 1024) < 0)
+        goto close_log;
+
+    if (opt.capture_path && mainloop.enable_capture(opt.capture_path) < 0)
+        goto close_log;
+
+    if (setup_realtime() < 0)
+        goto close_log;
+
+#ifdef STATIC_FOOTPRINT
+    seal_footprint(mainloop);
+#endif
+    log_info("RSS at startup: %zu KiB", rss_bytes() / 1024);
+
+    mainloop.set_busy_poll(opt.busy_poll_us);
+    mainloop.set_latency_budget(opt.latency_budget_ms * USEC_PER_MSEC);
+
     mainloop.report_msg_statistics = opt.report_msg_statistics;
 
     mainloop.loop();
 
-    free_endpoints();
+#ifdef STATIC_FOOTPRINT
+    arena_set_sealed(false);
+#endif
 
-    log_close();
-
-    return 0;
+    ret = 0;
 
 close_log:
+    free_endpoint_addresses();
+    free(opt.replay_path);
     log_close();
-    return EXIT_FAILURE;
+    return ret;
 }
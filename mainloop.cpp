@@ -0,0 +1,807 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mainloop.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "log.h"
+#include "util.h"
+
+/* With --report_msg_statistics */
+#define STATS_INTERVAL_USEC (1 * USEC_PER_SEC)
+
+#define MAX_READS_PER_WAKEUP 64
+
+Mainloop::Mainloop()
+{
+    timer_wheel_init(&_timers, now_usec());
+    timer_init(&_stats_timer, _stats_timer_cb, this);
+}
+
+Mainloop::~Mainloop()
+{
+    if (_endpoints) {
+        for (Endpoint **e = _endpoints; *e; e++)
+            delete *e;
+        free(_endpoints);
+    }
+
+    if (_monitors) {
+        for (Endpoint **e = _monitors; *e; e++)
+            delete *e;
+        free(_monitors);
+    }
+
+    delete _master;
+    delete _cache;
+    delete _mesh;
+    delete _commands;
+    delete _blackbox;
+    delete _capture;
+
+    if (_unix_fd >= 0) {
+        close(_unix_fd);
+        unlink(_unix_path);
+    }
+    free(_unix_path);
+
+    if (_timer_fd >= 0)
+        close(_timer_fd);
+
+    if (epollfd >= 0)
+        close(epollfd);
+}
+
+int Mainloop::open()
+{
+    if (epollfd != -1)
+        return -EBUSY;
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epollfd == -1) {
+        log_error_errno(errno, "%m");
+        return -1;
+    }
+
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (_timer_fd < 0) {
+        log_error_errno(errno, "Could not create timerfd (%m)");
+        return -1;
+    }
+
+    if (add_fd(_timer_fd, &_timer_fd, EPOLLIN) < 0)
+        return -1;
+
+    return 0;
+}
+
+int Mainloop::mod_fd(int fd, void *data, int events)
+{
+    struct epoll_event epev = { };
+
+    epev.events = events;
+    epev.data.ptr = data;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &epev) < 0) {
+        log_error_errno(errno, "Could not mod fd (%m)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int Mainloop::add_fd(int fd, void *data, int events)
+{
+    struct epoll_event epev = { };
+
+    epev.events = events;
+    epev.data.ptr = data;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+        log_error_errno(errno, "Could not add fd to epoll (%m)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int Mainloop::add_endpoint(Endpoint *e, bool master)
+{
+    assert(e);
+
+    if (master) {
+        if (_master)
+            return -EEXIST;
+    } else {
+        Endpoint **endpoints = (Endpoint **) realloc(_endpoints,
+                                                     (_n_endpoints + 2) * sizeof(Endpoint *));
+        if (!endpoints)
+            return -ENOMEM;
+
+        _endpoints = endpoints;
+    }
+
+    if (e->fd >= 0 && add_fd(e->fd, e, EPOLLIN) < 0)
+        return -1;
+
+    e->id = _next_id++;
+    e->mainloop = this;
+    timer_init(&e->flush_timer, _flush_timer_cb, e);
+    _sync_flush_timer(e);
+
+    if (master) {
+        _master = e;
+    } else {
+        _endpoints[_n_endpoints++] = e;
+        _endpoints[_n_endpoints] = nullptr;
+    }
+
+    return 0;
+}
+
+int Mainloop::add_monitor(Endpoint *e)
+{
+    assert(e);
+
+    Endpoint **monitors = (Endpoint **) realloc(_monitors,
+                                                (_n_monitors + 2) * sizeof(Endpoint *));
+    if (!monitors)
+        return -ENOMEM;
+
+    _monitors = monitors;
+
+    if (e->fd >= 0 && add_fd(e->fd, e, EPOLLIN) < 0)
+        return -1;
+
+    e->id = _next_id++;
+    e->mainloop = this;
+    timer_init(&e->flush_timer, _flush_timer_cb, e);
+    _monitors[_n_monitors++] = e;
+    _monitors[_n_monitors] = nullptr;
+
+    return 0;
+}
+
+int Mainloop::add_unix_listener(const char *path, bool conflate)
+{
+    struct sockaddr_un addr = { };
+
+    if (_unix_fd >= 0)
+        return -EBUSY;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Unix socket path too long: %s", path);
+        return -EINVAL;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    _unix_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_unix_fd == -1) {
+        log_error_errno(errno, "Could not create unix socket (%m)");
+        return -1;
+    }
+
+    /* Stale socket from a previous run */
+    unlink(path);
+
+    if (bind(_unix_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error_errno(errno, "Error binding unix socket %s (%m)", path);
+        goto fail;
+    }
+
+    if (listen(_unix_fd, SOMAXCONN) < 0) {
+        log_error_errno(errno, "Error listening on unix socket (%m)");
+        goto fail;
+    }
+
+    if (add_fd(_unix_fd, &_unix_fd, EPOLLIN) < 0)
+        goto fail;
+
+    _unix_path = strdup(path);
+    _unix_conflate = conflate;
+    log_info("Listen on unix socket %s", path);
+
+    return 0;
+
+fail:
+    close(_unix_fd);
+    _unix_fd = -1;
+    return -1;
+}
+
+void Mainloop::_accept_unix_client()
+{
+    UnixEndpoint *client = new UnixEndpoint{};
+
+    if (_unix_conflate)
+        client->enable_conflation();
+
+    if (client->accept(_unix_fd) < 0 || add_endpoint(client) < 0)
+        delete client;
+}
+
+void Mainloop::_remove_hung_up()
+{
+    _should_process_hangups = false;
+
+    for (unsigned int i = 0; i < _n_endpoints;) {
+        Endpoint *e = _endpoints[i];
+
+        if (!e->hung_up) {
+            i++;
+            continue;
+        }
+
+        log_info("Removing endpoint %u: peer went away", e->id);
+
+        /* move the NULL terminator too */
+        memmove(&_endpoints[i], &_endpoints[i + 1], (_n_endpoints - i) * sizeof(Endpoint *));
+        _n_endpoints--;
+
+        if (_master)
+            _master->forget_peer(e);
+        for (unsigned int j = 0; j < _n_endpoints; j++)
+            _endpoints[j]->forget_peer(e);
+        for (unsigned int j = 0; j < _n_monitors; j++)
+            _monitors[j]->forget_peer(e);
+        if (_commands)
+            _commands->forget_endpoint(e);
+        if (_cache)
+            _cache->forget_endpoint(e);
+
+        del_timer(&e->flush_timer);
+
+        /* closing the fd also removes it from epoll */
+        delete e;
+    }
+}
+
+int Mainloop::enable_cache()
+{
+    if (_cache)
+        return -EBUSY;
+
+    _cache = new VehicleCache{*this};
+
+    return 0;
+}
+
+int Mainloop::enable_command_coalescing()
+{
+    if (_commands)
+        return -EBUSY;
+
+    _commands = new CommandCoalescer{*this};
+
+    return 0;
+}
+
+int Mainloop::enable_mesh()
+{
+    if (_mesh)
+        return -EBUSY;
+
+    _mesh = new MeshFilter{};
+
+    return 0;
+}
+
+int Mainloop::enable_blackbox(const char *path, size_t size)
+{
+    BlackBox *blackbox;
+
+    if (_blackbox)
+        return -EBUSY;
+
+    blackbox = new BlackBox{};
+    if (blackbox->open(path, size) < 0) {
+        delete blackbox;
+        return -1;
+    }
+    _blackbox = blackbox;
+
+    return 0;
+}
+
+void Mainloop::request_blackbox_dump()
+{
+    if (_blackbox)
+        _blackbox->dump_requested = 1;
+}
+
+void Mainloop::dump_blackbox_on_crash()
+{
+    if (_blackbox)
+        _blackbox->dump_on_crash();
+}
+
+int Mainloop::enable_capture(const char *path)
+{
+    Capture *capture;
+
+    if (_capture)
+        return -EBUSY;
+
+    capture = new Capture{};
+    if (capture->open(path) < 0) {
+        delete capture;
+        return -1;
+    }
+    _capture = capture;
+
+    return 0;
+}
+
+/*
+ * Time a packet received at @rx_timestamp has been in the router. It's
+ * taken after each write, so it includes the write and the ones before it.
+ */
+static inline bool dwell_since(nsec_t rx_timestamp, nsec_t *dwell)
+{
+    nsec_t now;
+
+    if (!rx_timestamp)
+        return false;
+
+    now = now_realtime_nsec();
+
+    /* Clock may have been stepped back */
+    if (now < rx_timestamp)
+        return false;
+
+    *dwell = now - rx_timestamp;
+    return true;
+}
+
+void Mainloop::write_msg(Endpoint *e, const struct buffer *buf,
+                         const Endpoint *from, nsec_t rx_timestamp)
+{
+    struct frame_info frame;
+
+    frame_parse(buf, 0, rx_timestamp, &frame);
+    _write_msg(e, buf, &frame, from);
+}
+
+void Mainloop::write_on_behalf(Endpoint *e, struct buffer *buf, uint8_t last_seq)
+{
+    const struct msg_meta *meta;
+    struct frame_info frame;
+    int seq;
+
+    frame_parse(buf, 0, 0, &frame);
+    meta = msg_meta_get(frame.msgid);
+
+    seq = e->take_seq(frame.sysid, frame.compid, last_seq);
+    if (seq >= 0 && meta)
+        frame_set_seq(buf->data, &frame, meta, seq);
+
+    _write_msg(e, buf, &frame, nullptr);
+}
+
+void Mainloop::_forward_msg(Endpoint *e, const struct buffer *buf,
+                            const struct frame_info *frame, const Endpoint *from)
+{
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer renumbered = { 0, data };
+    struct frame_info renumbered_frame;
+
+    /* Follow packets the router wrote on behalf of the same component */
+    if (e->renumbering() && e->renumber(buf, frame, &renumbered, &renumbered_frame)) {
+        buf = &renumbered;
+        frame = &renumbered_frame;
+    }
+
+    _write_msg(e, buf, frame, from);
+}
+
+void Mainloop::_write_msg(Endpoint *e, const struct buffer *buf,
+                          const struct frame_info *frame, const Endpoint *from)
+{
+    nsec_t dwell;
+
+    if (e->liveness_timeout() && !e->liveness_check(now_usec()))
+        return;
+
+    int r = e->write_msg(buf, frame);
+
+    if (e->hung_up)
+        _should_process_hangups = true;
+
+    /* Nobody listening on the other side */
+    if (r == -ECONNREFUSED && e->liveness_timeout())
+        e->park(now_usec());
+
+    if (r > 0 && from && dwell_since(frame->rx_timestamp, &dwell))
+        e->record_dwell(from, dwell);
+
+    /*
+     * If endpoint would block, add EPOLLOUT event to get notified when it's
+     * possible to write again
+     */
+    if (r == -EAGAIN)
+        mod_fd(e->fd, e, EPOLLIN | EPOLLOUT);
+
+    _sync_flush_timer(e);
+}
+
+void Mainloop::route_msg(Endpoint *endpoint, const struct buffer *buf)
+{
+    struct frame_info frame;
+
+    frame_parse(buf, endpoint->id, endpoint->rx_timestamp(), &frame);
+    route_msg(endpoint, buf, &frame);
+}
+
+void Mainloop::route_msg(Endpoint *endpoint, const struct buffer *buf,
+                          const struct frame_info *frame)
+{
+    unsigned int first_ingress = frame->ingress;
+
+    if (_mesh && !_mesh->add(frame, now_usec(), &first_ingress) && endpoint->router_link) {
+        /* Went around a loop of routers */
+        _mesh->duplicates_total++;
+        return;
+    }
+
+    if (_blackbox)
+        _blackbox->record(frame, buf, endpoint == _master);
+    if (_capture)
+        _capture->record(frame, buf);
+
+    /*
+     * Currently this makes the flight stack endpoint (master) as a special
+     * one: packets from master goes to the other connected endpoints and
+     * packets from endpoints go to master.
+     *
+     * This logic should be replaced with a routing logic so each endpoint
+     * can talk to each one without involving the flight stack.
+     */
+    if (endpoint == _master) {
+        if (_cache)
+            _cache->handle_from_vehicle(frame, buf);
+
+        for (unsigned int i = 0; i < _n_endpoints; i++) {
+            /* Split horizon: the router it came from already has it */
+            if (_endpoints[i]->id == first_ingress && _endpoints[i]->router_link) {
+                if (_mesh)
+                    _mesh->reflections_total++;
+                continue;
+            }
+            _forward_msg(_endpoints[i], buf, frame, endpoint);
+        }
+
+        /* After the ACK itself, so copies go after it */
+        if (_commands)
+            _commands->handle_from_vehicle(frame, buf);
+    } else if (_master) {
+        if ((!_cache || !_cache->handle_to_vehicle(endpoint, frame, buf))
+            && (!_commands || !_commands->handle_to_vehicle(endpoint, frame, buf)))
+            _forward_msg(_master, buf, frame, endpoint);
+    }
+
+    for (unsigned int i = 0; i < _n_monitors; i++)
+        _forward_msg(_monitors[i], buf, frame, nullptr);
+}
+
+void Mainloop::handle_read(Endpoint *endpoint)
+{
+    assert(endpoint);
+
+    struct buffer buf{};
+    struct frame_info frame;
+    /*
+     * read_msg() doesn't read again after handling what a read got, so
+     * endpoints get turns. When sleeping between wakeups that would leave
+     * data behind for too long: drain a bounded number of reads instead.
+     */
+    unsigned int reads = _latency_budget ? MAX_READS_PER_WAKEUP : 1;
+    bool routed = true;
+
+    /* We read from this endpoint and forward to the other endpoints */
+    for (unsigned int i = 0; i < reads && routed; i++) {
+        routed = false;
+
+        while (endpoint->read_msg(&buf, &frame) > 0) {
+            /* Only meaningful if it's the kernel timestamp, taken before waking up */
+            if (frame.rx_timestamp && frame.rx_timestamp <= _wakeup_ts)
+                histogram_record(&_wakeup_latency, _wakeup_ts - frame.rx_timestamp);
+
+            route_msg(endpoint, &buf, &frame);
+            routed = true;
+        }
+    }
+
+    if (endpoint->hung_up)
+        _should_process_hangups = true;
+
+    if (_busy_poll)
+        _last_activity = now_usec();
+}
+
+void Mainloop::handle_canwrite(Endpoint *e)
+{
+    int r = e->flush_pending_msgs();
+
+    /*
+     * If we could flush everything without triggering another block write,
+     * remove EPOLLOUT from flags so we don't get called again
+     */
+    if (e->hung_up)
+        _should_process_hangups = true;
+    else if (r != -EAGAIN)
+        mod_fd(e->fd, e, EPOLLIN);
+
+    _sync_flush_timer(e);
+}
+
+/* Keep the flush timer of @e armed for its flush deadline */
+void Mainloop::_sync_flush_timer(Endpoint *e)
+{
+    const usec_t deadline = e->flush_deadline();
+
+    if (deadline == USEC_INFINITY) {
+        del_timer(&e->flush_timer);
+        return;
+    }
+
+    if (!timer_pending(&e->flush_timer) || e->flush_timer.expires != timer_tick(deadline))
+        add_timer(&e->flush_timer, deadline);
+}
+
+void Mainloop::_flush_timer_cb(void *data)
+{
+    Endpoint *e = static_cast<Endpoint*>(data);
+    Mainloop *mainloop = e->mainloop;
+
+    if (e->flush_pending_msgs() == -EAGAIN)
+        mainloop->mod_fd(e->fd, e, EPOLLIN | EPOLLOUT);
+
+    mainloop->_sync_flush_timer(e);
+}
+
+void Mainloop::_stats_timer_cb(void *data)
+{
+    Mainloop *mainloop = static_cast<Mainloop*>(data);
+
+    mainloop->print_statistics();
+    mainloop->add_timer(&mainloop->_stats_timer, now_usec() + STATS_INTERVAL_USEC);
+}
+
+/*
+ * Wake up from epoll_wait() for the next timer. Timers are in the time of
+ * now_usec(), which may not be CLOCK_MONOTONIC, so the timerfd is armed
+ * relative to it.
+ */
+void Mainloop::_arm_timerfd()
+{
+    const usec_t expiry = next_deadline();
+    struct itimerspec its = { };
+
+    /* loop() doesn't wait for due timers */
+    if (expiry == _timer_fd_expiry || expiry == 0)
+        return;
+
+    /* all zero disarms it */
+    if (expiry != USEC_INFINITY) {
+        const usec_t now = now_usec();
+        const usec_t delay = expiry > now ? expiry - now : 0;
+
+        its.it_value.tv_sec = delay / USEC_PER_SEC;
+        its.it_value.tv_nsec = (delay % USEC_PER_SEC) * NSEC_PER_USEC;
+        /* 0 would disarm it */
+        if (delay == 0)
+            its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(_timer_fd, 0, &its, NULL) < 0) {
+        log_error_errno(errno, "Could not arm timerfd (%m)");
+        return;
+    }
+
+    _timer_fd_expiry = expiry;
+}
+
+void Mainloop::preallocate()
+{
+    /* packets may come from any endpoint */
+    if (_master)
+        _master->preallocate(_next_id);
+
+    for (unsigned int i = 0; i < _n_endpoints; i++)
+        _endpoints[i]->preallocate(_next_id);
+
+    for (unsigned int i = 0; i < _n_monitors; i++)
+        _monitors[i]->preallocate(_next_id);
+}
+
+void Mainloop::print_statistics()
+{
+    if (_master)
+        _master->print_statistics();
+
+    for (unsigned int i = 0; i < _n_endpoints; i++)
+        _endpoints[i]->print_statistics();
+
+    for (unsigned int i = 0; i < _n_monitors; i++)
+        _monitors[i]->print_statistics();
+
+    if (_cache)
+        _cache->print_statistics();
+
+    if (_commands)
+        _commands->print_statistics();
+
+    if (_mesh)
+        _mesh->print_statistics();
+
+    if (_blackbox)
+        _blackbox->print_statistics();
+
+    if (_capture)
+        _capture->print_statistics();
+
+    if (_loop_start) {
+        usec_t elapsed = now_usec() - _loop_start;
+
+        printf("Mainloop {" \
+               "\n\twakeups: %" PRIu64 \
+               "\n\twakeups per second: %.1f" \
+               "\n}" \
+               "\n",
+               _wakeups, _wakeups * (double) USEC_PER_SEC / (elapsed ? elapsed : 1));
+    }
+
+    if (_wakeup_latency.count) {
+        const struct histogram *h = &_wakeup_latency;
+
+        printf("Wakeup latency (us) {" \
+               "\n\tmessages: %" PRIu64 \
+               "\n\tp50: %.1f" \
+               "\n\tp99: %.1f" \
+               "\n\tp99.9: %.1f" \
+               "\n\tmax: %.1f" \
+               "\n}" \
+               "\n",
+               h->count,
+               histogram_percentile(h, 50) / (double) NSEC_PER_USEC,
+               histogram_percentile(h, 99) / (double) NSEC_PER_USEC,
+               histogram_percentile(h, 99.9) / (double) NSEC_PER_USEC,
+               h->max / (double) NSEC_PER_USEC);
+    }
+}
+
+bool Mainloop::_sleep_budget(usec_t until)
+{
+    usec_t deadline = next_deadline();
+    usec_t now = now_usec();
+    struct timespec ts;
+
+    /* Don't hold back data that must be flushed before */
+    if (deadline < until)
+        until = deadline;
+    if (until <= now)
+        return false;
+
+    /* Relative: @until is in the time of now_usec() */
+    ts.tv_sec = (until - now) / USEC_PER_SEC;
+    ts.tv_nsec = ((until - now) % USEC_PER_SEC) * NSEC_PER_USEC;
+
+    /* Waking up from the sleep costs as much as from epoll_wait() */
+    for (;;) {
+        int r = clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts);
+
+        _wakeups++;
+        if (r != EINTR || _should_exit)
+            break;
+    }
+
+    return true;
+}
+
+void Mainloop::loop()
+{
+    const int max_events = 8;
+    struct epoll_event events[max_events];
+    bool slept = false;
+    int r;
+
+    if (epollfd < 0)
+        return;
+
+    _loop_start = now_usec();
+
+    if (report_msg_statistics)
+        add_timer(&_stats_timer, _loop_start + STATS_INTERVAL_USEC);
+
+    _arm_timerfd();
+
+    while (!_should_exit) {
+        int timeout = -1;
+        int i;
+
+        if (_blackbox && _blackbox->dump_requested)
+            _blackbox->dump();
+
+        /* After a budget sleep, what came meanwhile doesn't wake us up again */
+        if ((_busy_poll && now_usec() - _last_activity < _busy_poll)
+            || timer_wheel_due(&_timers) || slept)
+            timeout = 0;
+        slept = false;
+
+        r = epoll_wait(epollfd, events, max_events, timeout);
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r > 0) {
+            _wakeup_ts = now_realtime_nsec();
+            /* Only count returns from a blocking wait */
+            if (timeout != 0)
+                _wakeups++;
+        }
+
+        for (i = 0; i < r; i++) {
+            if (events[i].data.ptr == &_unix_fd) {
+                _accept_unix_client();
+                continue;
+            }
+
+            if (events[i].data.ptr == &_timer_fd) {
+                uint64_t expirations;
+
+                if (read(_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    log_error_errno(errno, "Could not read timerfd (%m)");
+                /* not periodic, so it is disarmed now */
+                _timer_fd_expiry = USEC_INFINITY;
+                continue;
+            }
+
+            Endpoint *e = static_cast<Endpoint*>(events[i].data.ptr);
+
+            if (events[i].events & EPOLLIN)
+                handle_read(e);
+
+            if (events[i].events & EPOLLOUT && !e->hung_up)
+                handle_canwrite(e);
+        }
+
+        /* Only now that no event refers to them anymore */
+        if (_should_process_hangups)
+            _remove_hung_up();
+
+        run_timers(now_usec());
+        _arm_timerfd();
+
+        if (_latency_budget && r > 0)
+            slept = _sleep_budget(now_usec() + _latency_budget);
+    }
+}
@@ -0,0 +1,224 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "blackbox.h"
+#include "cache.h"
+#include "capture.h"
+#include "coalesce.h"
+#include "comm.h"
+#include "mesh.h"
+
+/*
+ * Routing core. Applications may embed it instead of talking to
+ * mavlink-routerd over a socket:
+ *
+ *   Mainloop mainloop;
+ *   mainloop.open();
+ *   mainloop.add_endpoint(uart, true);
+ *   mainloop.add_endpoint(new CallbackEndpoint{"app", on_msg, app});
+ *   mainloop.loop();
+ *
+ * Endpoints added to the Mainloop are owned by it and deleted on its
+ * destruction.
+ *
+ * For simulation, VirtualEndpoints can be driven without loop() by calling
+ * handle_read() and run_timers() directly, with the clock replaced by
+ * set_clock() before creating the Mainloop. See examples/virtual-bench.cpp.
+ */
+class _public_ Mainloop {
+public:
+    Mainloop();
+    ~Mainloop();
+
+    int open();
+    int add_fd(int fd, void *data, int events);
+    int mod_fd(int fd, void *data, int events);
+
+    /*
+     * Add endpoint to the routing. Endpoints with a valid fd are also
+     * polled for data. There's only one master endpoint: packets from it
+     * go to all the others and packets from the others go to it.
+     */
+    int add_endpoint(Endpoint *e, bool master = false);
+
+    /*
+     * Add eavesdrop endpoint: it gets a copy of every packet routed, in any
+     * direction, and packets read from it are never routed.
+     */
+    int add_monitor(Endpoint *e);
+
+    /*
+     * Listen for local clients on an AF_UNIX SOCK_SEQPACKET socket at
+     * @path. Each client becomes an endpoint, removed when it disconnects.
+     * With @conflate, clients that fall behind get the latest of each state
+     * message instead of a backlog, see UnixEndpoint::enable_conflation().
+     */
+    int add_unix_listener(const char *path, bool conflate = false);
+
+    /*
+     * Cache parameters and mission of the vehicle behind the master
+     * endpoint and answer requests for them from the other endpoints.
+     */
+    int enable_cache();
+
+    /*
+     * Send only one copy of the same COMMAND_LONG from several requesters
+     * to the vehicle while it's in flight, and give each of them the ACK
+     */
+    int enable_command_coalescing();
+
+    /*
+     * Drop packets that come back through endpoints marked as router links,
+     * and don't send packets back to the router link they came from
+     */
+    int enable_mesh();
+
+    /*
+     * Record every packet routed in a ring of @size bytes backed by the file
+     * at @path. A dump of the ring is written to a file next to it when
+     * requested with request_blackbox_dump(), e.g. from a signal handler, or
+     * by a COMMAND_LONG MAV_CMD_USER_1 with param1 = 1 sent to component
+     * MAV_COMP_ID_LOG of the vehicle. Dumps are written by another thread.
+     */
+    int enable_blackbox(const char *path, size_t size);
+    void request_blackbox_dump();
+    /* Dump from a fatal signal handler */
+    void dump_blackbox_on_crash();
+
+    /*
+     * Capture every packet routed to the file at @path, to be replayed with
+     * a ReplayEndpoint
+     */
+    int enable_capture(const char *path);
+
+    /*
+     * Route a packet received by endpoint @e that doesn't have a fd, e.g. a
+     * CallbackEndpoint, as if it were read from it.
+     */
+    void route_msg(Endpoint *e, const struct buffer *buf);
+    /* route_msg() of a packet already described by @frame */
+    void route_msg(Endpoint *e, const struct buffer *buf, const struct frame_info *frame);
+
+    void loop();
+    void request_exit() { _should_exit = true; }
+
+    /*
+     * Have the endpoints allocate now what they would once packets flow,
+     * so nothing is allocated after startup. See arena.h.
+     */
+    void preallocate();
+
+    /*
+     * Low-latency mode: after handling packets keep polling with a zero
+     * timeout for @window before blocking in epoll_wait() again, trading
+     * CPU for the latency of being woken up. 0 disables it.
+     */
+    void set_busy_poll(usec_t window) { _busy_poll = window; }
+
+    /*
+     * Power-saving mode, the opposite of busy polling: after handling
+     * packets sleep for @budget so more input accumulates, then handle all
+     * of it in one go. Wakeups are limited to one per @budget while adding
+     * at most @budget of latency. 0 disables it.
+     */
+    void set_latency_budget(usec_t budget) { _latency_budget = budget; }
+
+    void handle_read(Endpoint *e);
+    void handle_canwrite(Endpoint *e);
+    /*
+     * Write packet to endpoint @e. If @from and @rx_timestamp are given, the
+     * time since the packet was received is accounted in @e's statistics.
+     */
+    void write_msg(Endpoint *e, const struct buffer *buf,
+                   const Endpoint *from = nullptr, nsec_t rx_timestamp = 0);
+    /*
+     * Write packet made up on behalf of the component it's from, e.g. a
+     * reply from the cache, to @e. It's given the seq after @last_seq, the
+     * last one the component sent, see Endpoint::take_seq().
+     */
+    void write_on_behalf(Endpoint *e, struct buffer *buf, uint8_t last_seq);
+    void print_statistics();
+
+    /*
+     * Timers, run from loop() with the time of now_usec(). Endpoints holding
+     * data back get a timer for their flush_deadline().
+     */
+    void add_timer(struct timer *t, usec_t expires) { timer_add(&_timers, t, expires); }
+    void del_timer(struct timer *t) { timer_del(&_timers, t); }
+    /* Run the timers expired by @now */
+    void run_timers(usec_t now) { timer_wheel_run(&_timers, now); }
+    /* Earliest timer, USEC_INFINITY if none */
+    usec_t next_deadline() const { return timer_wheel_next_expiry(&_timers); }
+
+    int epollfd = -1;
+    bool report_msg_statistics = false;
+
+private:
+    bool _sleep_budget(usec_t until);
+    void _accept_unix_client();
+    void _remove_hung_up();
+    void _sync_flush_timer(Endpoint *e);
+    /* Write routed packet, renumbered if @e needs it, see Endpoint::renumber() */
+    void _forward_msg(Endpoint *e, const struct buffer *buf, const struct frame_info *frame,
+                      const Endpoint *from);
+    /* write_msg() of packet @buf described by @frame */
+    void _write_msg(Endpoint *e, const struct buffer *buf, const struct frame_info *frame,
+                    const Endpoint *from);
+    void _arm_timerfd();
+    static void _flush_timer_cb(void *data);
+    static void _stats_timer_cb(void *data);
+
+    Endpoint *_master = nullptr;
+    /* NULL-terminated list of the non-master endpoints */
+    Endpoint **_endpoints = nullptr;
+    unsigned int _n_endpoints = 0;
+    /* NULL-terminated list of monitor endpoints */
+    Endpoint **_monitors = nullptr;
+    unsigned int _n_monitors = 0;
+    unsigned int _next_id = 0;
+    VehicleCache *_cache = nullptr;
+    MeshFilter *_mesh = nullptr;
+    CommandCoalescer *_commands = nullptr;
+    BlackBox *_blackbox = nullptr;
+    Capture *_capture = nullptr;
+
+    struct timer_wheel _timers;
+    int _timer_fd = -1;
+    /* what _timer_fd is armed for, USEC_INFINITY if disarmed */
+    usec_t _timer_fd_expiry = USEC_INFINITY;
+    struct timer _stats_timer;
+
+    int _unix_fd = -1;
+    char *_unix_path = nullptr;
+    bool _unix_conflate = false;
+    bool _should_process_hangups = false;
+
+    usec_t _busy_poll = 0;
+    usec_t _last_activity = 0;
+    usec_t _latency_budget = 0;
+
+    usec_t _loop_start = 0;
+    uint64_t _wakeups = 0;
+
+    /* time packets waited in the kernel until we woke up to read them */
+    nsec_t _wakeup_ts = 0;
+    struct histogram _wakeup_latency = { };
+
+    volatile bool _should_exit = false;
+};
@@ -0,0 +1,124 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mesh.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Number of entries, power of 2 */
+#define TABLE_BITS 13
+#define TABLE_SIZE (1U << TABLE_BITS)
+
+/* Slots looked at before evicting */
+#define MAX_PROBES 8
+
+/*
+ * How long a packet is remembered. Far more than a trip around a loop of
+ * radios, and short enough that a sequence number is seldom reused with
+ * the same checksum within it.
+ */
+#define WINDOW_MSEC 1000U
+
+/* Set in every key so 0 marks an unused entry */
+#define KEY_USED (1ULL << 40)
+
+struct MeshFilter::entry {
+    /* sysid << 32 | compid << 24 | seq << 16 | crc, with KEY_USED */
+    uint64_t key;
+    /* msec, wrapping */
+    uint32_t seen;
+    uint32_t ingress;
+};
+
+MeshFilter::MeshFilter()
+{
+    _entries = (struct entry *) calloc(TABLE_SIZE, sizeof(*_entries));
+    assert(_entries);
+}
+
+MeshFilter::~MeshFilter()
+{
+    free(_entries);
+}
+
+size_t MeshFilter::footprint()
+{
+    return sizeof(MeshFilter) + TABLE_SIZE * sizeof(struct entry);
+}
+
+static uint64_t packet_key(const struct frame_info *frame)
+{
+    return KEY_USED | (uint64_t) frame->sysid << 32 | (uint64_t) frame->compid << 24
+        | (uint64_t) frame->seq << 16 | frame->crc;
+}
+
+bool MeshFilter::add(const struct frame_info *frame, usec_t now, unsigned int *first_ingress)
+{
+    const uint64_t key = packet_key(frame);
+    const uint32_t now_ms = now / USEC_PER_MSEC;
+    /* Fibonacci hashing */
+    unsigned int slot = (key * 0x9e3779b97f4a7c15ULL) >> (64 - TABLE_BITS);
+    struct entry *victim = nullptr;
+    bool victim_live = true;
+
+    _packets_total++;
+
+    for (unsigned int i = 0; i < MAX_PROBES; i++, slot = (slot + 1) & (TABLE_SIZE - 1)) {
+        struct entry *e = &_entries[slot];
+        const bool expired = !e->key || now_ms - e->seen >= WINDOW_MSEC;
+
+        if (e->key == key && !expired) {
+            *first_ingress = e->ingress;
+            return false;
+        }
+
+        if (expired) {
+            if (victim_live) {
+                victim = e;
+                victim_live = false;
+            }
+            /* Never used: the key can't be any further */
+            if (!e->key)
+                break;
+        } else if (victim_live && (!victim || now_ms - e->seen > now_ms - victim->seen)) {
+            victim = e;
+        }
+    }
+
+    if (victim_live)
+        _evicted_total++;
+
+    victim->key = key;
+    victim->seen = now_ms;
+    victim->ingress = frame->ingress;
+
+    return true;
+}
+
+void MeshFilter::print_statistics()
+{
+    printf("Mesh {"
+           "\n\tpackets seen: %u"
+           "\n\tduplicates dropped: %u"
+           "\n\treflections suppressed: %u"
+           "\n\tevicted early: %u"
+           "\n}"
+           "\n",
+           _packets_total, duplicates_total, reflections_total, _evicted_total);
+}
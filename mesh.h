@@ -0,0 +1,62 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+
+#include "frame.h"
+#include "util.h"
+
+/*
+ * Loop suppression for meshes of routers. Routers chained over UDP, maybe
+ * with redundant links, mark the endpoints going to each other as router
+ * links. Every packet routed is remembered by (sysid, compid, seq, crc) for
+ * a short while, so when one comes back through a router link it's dropped
+ * instead of going around the loop again.
+ *
+ * The set is a fixed-size open-addressing table: entries age out instead of
+ * being deleted, and an insertion that finds no free or expired slot within
+ * a few probes evicts the oldest of them.
+ */
+class MeshFilter {
+public:
+    MeshFilter();
+    ~MeshFilter();
+
+    /* Memory used by a filter, for the static footprint of mavlink-routerd */
+    _public_ static size_t footprint();
+
+    /*
+     * Remember packet @frame at @now. Returns false if it was seen recently,
+     * with @first_ingress set to the endpoint it was first received on.
+     */
+    bool add(const struct frame_info *frame, usec_t now, unsigned int *first_ingress);
+
+    void print_statistics();
+
+    uint32_t duplicates_total = 0;
+    uint32_t reflections_total = 0;
+
+private:
+    struct entry;
+
+    struct entry *_entries;
+
+    uint32_t _packets_total = 0;
+    uint32_t _evicted_total = 0;
+};
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "macro.h"
+
+/*
+ * Per-message metadata, looked up in O(1) by msgid. The table is generated
+ * at build time by tools/msgmeta-gen.py from the C library generated by
+ * mavgen, so it has the same messages mavlink_get_msg_entry() knows about
+ * without the binary search.
+ */
+struct msg_meta {
+    uint8_t crc_extra;
+    /* payload length without and with mavlink 2 extensions */
+    uint8_t min_len;
+    uint8_t max_len;
+    uint8_t flags;
+    /* offset in payload of target_system/target_component, if any */
+    uint8_t target_system_ofs;
+    uint8_t target_component_ofs;
+};
+
+#define MSG_META_FLAG_HAVE_TARGET_SYSTEM        1
+#define MSG_META_FLAG_HAVE_TARGET_COMPONENT     2
+
+_public_ extern const uint32_t msg_meta_max_id;
+_public_ extern const struct msg_meta msg_meta_entries[];
+_public_ extern const uint16_t msg_meta_index[];
+
+/* Returns NULL for messages unknown to this build */
+static inline const struct msg_meta *msg_meta_get(uint32_t msgid)
+{
+    if (msgid > msg_meta_max_id)
+        return NULL;
+
+    uint16_t i = msg_meta_index[msgid];
+
+    return i ? &msg_meta_entries[i] : NULL;
+}
+
+/*
+ * Get target system/component from the payload. Mavlink 2 truncates zeros at
+ * the end of the payload, so offsets beyond it mean target is 0, i.e.
+ * broadcast. Values are set to -1 if the message has no such field.
+ */
+static inline void msg_meta_get_target(const struct msg_meta *meta,
+                                       const uint8_t *payload, uint8_t payload_len,
+                                       int *target_sysid, int *target_compid)
+{
+    *target_sysid = -1;
+    *target_compid = -1;
+
+    if (meta->flags & MSG_META_FLAG_HAVE_TARGET_SYSTEM)
+        *target_sysid = meta->target_system_ofs < payload_len
+            ? payload[meta->target_system_ofs] : 0;
+
+    if (meta->flags & MSG_META_FLAG_HAVE_TARGET_COMPONENT)
+        *target_compid = meta->target_component_ofs < payload_len
+            ? payload[meta->target_component_ofs] : 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "timer.h"
+
+#include <string.h>
+
+#define LEVEL_MASK (TIMER_LEVEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_LEVEL_BITS)
+/* Ticks covered by all the levels */
+#define HORIZON (1ULL << LEVEL_SHIFT(TIMER_LEVELS))
+
+static uint64_t rotr64(uint64_t v, unsigned int n)
+{
+    n &= 63;
+    return n ? (v >> n) | (v << (64 - n)) : v;
+}
+
+static void unlink_timer(struct timer_wheel *w, struct timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+
+    if (t->level < TIMER_LEVELS && !w->slots[t->level][t->slot])
+        w->occupied[t->level] &= ~(1ULL << t->slot);
+
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void place(struct timer_wheel *w, struct timer *t)
+{
+    uint64_t expires = t->expires < w->tick ? w->tick : t->expires;
+    uint64_t delta = expires - w->tick;
+    struct timer **head;
+    unsigned int level;
+
+    if (delta >= HORIZON)
+        expires = w->tick + HORIZON - 1;
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < (1ULL << LEVEL_SHIFT(level + 1)))
+            break;
+    }
+
+    t->level = level;
+    t->slot = (expires >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+
+    head = &w->slots[level][t->slot];
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+
+    w->occupied[level] |= 1ULL << t->slot;
+}
+
+void timer_init(struct timer *t, void (*cb)(void *data), void *data)
+{
+    memset(t, 0, sizeof(*t));
+    t->cb = cb;
+    t->data = data;
+}
+
+void timer_wheel_init(struct timer_wheel *w, usec_t now)
+{
+    memset(w, 0, sizeof(*w));
+    w->tick = now / TIMER_TICK_USEC;
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, usec_t expires)
+{
+    if (t->pprev)
+        unlink_timer(w, t);
+
+    t->expires = timer_tick(expires);
+
+    /*
+     * The wheel never goes back: a tick already processed would otherwise
+     * be clamped to the next one, up to TIMER_TICK_USEC away
+     */
+    if (t->expires < w->tick) {
+        t->level = TIMER_LEVELS;
+        t->next = w->due;
+        if (t->next)
+            t->next->pprev = &t->next;
+        t->pprev = &w->due;
+        w->due = t;
+        return;
+    }
+
+    place(w, t);
+}
+
+void timer_del(struct timer_wheel *w, struct timer *t)
+{
+    if (t->pprev)
+        unlink_timer(w, t);
+}
+
+/* Earliest tick at or after w->tick with a slot to run or move down */
+static uint64_t next_tick(const struct timer_wheel *w)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (unsigned int l = 0; l < TIMER_LEVELS; l++) {
+        const uint64_t mask = (1ULL << LEVEL_SHIFT(l)) - 1;
+        uint64_t first, t;
+
+        if (!w->occupied[l])
+            continue;
+
+        /* first slot boundary of this level not processed yet */
+        first = (w->tick + mask) >> LEVEL_SHIFT(l);
+        t = (first + __builtin_ctzll(rotr64(w->occupied[l], first & LEVEL_MASK)))
+            << LEVEL_SHIFT(l);
+        if (t < next)
+            next = t;
+    }
+
+    return next;
+}
+
+usec_t timer_wheel_next_expiry(const struct timer_wheel *w)
+{
+    uint64_t tick;
+
+    if (w->due)
+        return 0;
+
+    tick = next_tick(w);
+
+    return tick == UINT64_MAX ? USEC_INFINITY : tick * TIMER_TICK_USEC;
+}
+
+/* Run the timers of @list, already taken out of the wheel */
+static void run_list(struct timer *list)
+{
+    struct timer *t;
+
+    if (list)
+        list->pprev = &list;
+
+    while (list) {
+        t = list;
+        list = t->next;
+        if (list)
+            list->pprev = &list;
+        t->next = NULL;
+        t->pprev = NULL;
+        t->cb(t->data);
+    }
+}
+
+static void process_tick(struct timer_wheel *w)
+{
+    const uint64_t tick = w->tick;
+    struct timer *list, *t;
+    unsigned int slot;
+
+    /* At a boundary of a level, its slot moves down */
+    for (unsigned int l = 1; l < TIMER_LEVELS; l++) {
+        if (tick & ((1ULL << LEVEL_SHIFT(l)) - 1))
+            break;
+
+        slot = (tick >> LEVEL_SHIFT(l)) & LEVEL_MASK;
+        list = w->slots[l][slot];
+        w->slots[l][slot] = NULL;
+        w->occupied[l] &= ~(1ULL << slot);
+
+        while (list) {
+            t = list;
+            list = t->next;
+            place(w, t);
+        }
+    }
+
+    /*
+     * Take the expired timers out of the wheel before running them, so
+     * callbacks re-arming timers don't put them back in this slot
+     */
+    slot = tick & LEVEL_MASK;
+    list = w->slots[0][slot];
+    w->slots[0][slot] = NULL;
+    w->occupied[0] &= ~(1ULL << slot);
+
+    w->tick++;
+
+    run_list(list);
+}
+
+void timer_wheel_run(struct timer_wheel *w, usec_t now)
+{
+    const uint64_t target = now / TIMER_TICK_USEC;
+    struct timer *due = w->due;
+
+    /* Re-armed for the past by their callbacks, they wait for the next call */
+    w->due = NULL;
+    run_list(due);
+
+    while (w->tick <= target) {
+        uint64_t next = next_tick(w);
+
+        if (next > target) {
+            w->tick = target + 1;
+            break;
+        }
+
+        w->tick = next;
+        process_tick(w);
+    }
+}
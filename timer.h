@@ -0,0 +1,108 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_LEVEL_SLOTS
+ * slots, each level TIMER_LEVEL_SLOTS times coarser than the one below.
+ * Timers are kept in the slot of their expiration at the finest level that
+ * covers it and moved down a level when the slot above comes due, so arming
+ * and cancelling are O(1) and idle timers cost nothing. A bitmap of the
+ * non-empty slots per level lets time advance over empty slots at once.
+ *
+ * Resolution is TIMER_TICK_USEC and timers never run early. Timers further
+ * away than the wheels cover, about 4.6 hours, run late. Timers are owned by
+ * their users: nothing is allocated.
+ */
+#define TIMER_TICK_USEC 1000ULL
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SLOTS (1U << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+
+struct timer {
+    struct timer *next;
+    /* NULL if not armed */
+    struct timer **pprev;
+    uint64_t expires;
+    /* TIMER_LEVELS if in the due list */
+    uint8_t level;
+    uint8_t slot;
+    void (*cb)(void *data);
+    void *data;
+};
+
+struct timer_wheel {
+    /* next tick to process */
+    uint64_t tick;
+    uint64_t occupied[TIMER_LEVELS];
+    struct timer *slots[TIMER_LEVELS][TIMER_LEVEL_SLOTS];
+    /* armed for a tick already processed: run on the next timer_wheel_run() */
+    struct timer *due;
+};
+
+_public_ void timer_init(struct timer *t, void (*cb)(void *data), void *data);
+
+/* Tick a timer expiring at @usec is due, rounded up */
+static inline uint64_t timer_tick(usec_t usec)
+{
+    return usec / TIMER_TICK_USEC + (usec % TIMER_TICK_USEC != 0);
+}
+
+static inline bool timer_pending(const struct timer *t)
+{
+    return t->pprev != NULL;
+}
+
+_public_ void timer_wheel_init(struct timer_wheel *w, usec_t now);
+
+/* Arm @t to run at @expires, re-arming it if it was already */
+_public_ void timer_add(struct timer_wheel *w, struct timer *t, usec_t expires);
+_public_ void timer_del(struct timer_wheel *w, struct timer *t);
+
+/*
+ * When timer_wheel_run() should be called next, USEC_INFINITY if never and
+ * 0 if right away, see timer_wheel_due()
+ */
+_public_ usec_t timer_wheel_next_expiry(const struct timer_wheel *w);
+
+/* Whether timers were armed for a time already past */
+static inline bool timer_wheel_due(const struct timer_wheel *w)
+{
+    return w->due != NULL;
+}
+
+/*
+ * Run the callbacks of the timers expired by @now. Callbacks may arm and
+ * cancel any timer; those they arm for a time already past run on the next
+ * call, so this always returns.
+ */
+_public_ void timer_wheel_run(struct timer_wheel *w, usec_t now);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,90 @@
+#!/usr/bin/python
+
+# This file is part of the MAVLink Router project
+#
+# Copyright (C) 2016  Intel Corporation. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Generate a direct-indexed table with the metadata of each message from the
+# C library generated by mavgen: the MAVLINK_MESSAGE_CRCS initializer of the
+# dialect and the layout of mavlink_msg_entry_t in mavlink_types.h, which
+# changed over time.
+#
+# Usage: msgmeta-gen.py <include/mavlink dir> [dialect]
+
+from __future__ import print_function
+
+import os
+import re
+import sys
+
+
+def entry_fields(types_h):
+    m = re.search(r'struct\s+__mavlink_msg_entry\s*{(.*?)}', types_h, re.S)
+    if not m:
+        raise Exception('mavlink_msg_entry_t not found')
+    body = re.sub(r'//[^\n]*|/\*.*?\*/', '', m.group(1), flags=re.S)
+    return re.findall(r'(\w+)\s*(?::\s*\d+)?\s*;', body)
+
+
+def message_entries(dialect_h):
+    m = re.search(r'#define\s+MAVLINK_MESSAGE_CRCS\s+{(.*)}\s*$', dialect_h, re.M)
+    if not m:
+        raise Exception('MAVLINK_MESSAGE_CRCS not found')
+    return [[int(v, 0) for v in e.split(',')]
+            for e in re.findall(r'{([^{}]*)}', m.group(1))]
+
+
+def main():
+    incdir = sys.argv[1]
+    dialect = sys.argv[2] if len(sys.argv) > 2 else 'common'
+
+    with open(os.path.join(incdir, 'mavlink_types.h')) as f:
+        fields = entry_fields(f.read())
+    with open(os.path.join(incdir, dialect, dialect + '.h')) as f:
+        entries = [dict(zip(fields, e)) for e in message_entries(f.read())]
+
+    entries.sort(key=lambda e: e['msgid'])
+    max_id = entries[-1]['msgid'] if entries else 0
+
+    print('/* Generated by msgmeta-gen.py from the %s dialect, do not edit */' % dialect)
+    print('')
+    print('constexpr uint32_t msg_meta_max_id = %d;' % max_id)
+    print('')
+    print('/* entry 0 is a placeholder for unknown messages */')
+    print('constexpr struct msg_meta msg_meta_entries[] = {')
+    print('    { 0, 0, 0, 0, 0, 0 },')
+    for e in entries:
+        # older mavgen only have the length of the whole payload
+        min_len = e.get('min_msg_len', e.get('msg_len'))
+        max_len = e.get('max_msg_len', e.get('msg_len'))
+        print('    { %d, %d, %d, %d, %d, %d }, /* %d */' % (
+            e['crc_extra'], min_len, max_len, e.get('flags', 0),
+            e.get('target_system_ofs', 0), e.get('target_component_ofs', 0),
+            e['msgid']))
+    print('};')
+    print('')
+
+    index = [0] * (max_id + 1)
+    for i, e in enumerate(entries):
+        index[e['msgid']] = i + 1
+
+    print('constexpr uint16_t msg_meta_index[] = {')
+    for i in range(0, len(index), 16):
+        print('    ' + ' '.join('%d,' % v for v in index[i:i + 16]))
+    print('};')
+
+
+if __name__ == '__main__':
+    main()
@@ -19,7 +19,10 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 usec_t ts_usec(const struct timespec *ts)
 {
@@ -35,15 +38,46 @@ usec_t ts_usec(const struct timespec *ts)
         (usec_t) ts->tv_nsec / NSEC_PER_USEC;
 }
 
+static usec_t (*clock_override)(void);
+
+void set_clock(usec_t (*clock)(void))
+{
+    clock_override = clock;
+}
+
 usec_t now_usec(void)
 {
     struct timespec ts;
 
+    if (clock_override)
+        return clock_override();
+
     clock_gettime(CLOCK_MONOTONIC, &ts);
 
     return ts_usec(&ts);
 }
 
+nsec_t ts_nsec(const struct timespec *ts)
+{
+    return (nsec_t) ts->tv_sec * NSEC_PER_SEC + (nsec_t) ts->tv_nsec;
+}
+
+/*
+ * Same clock used by the kernel for SO_TIMESTAMPNS, so it can be compared
+ * to the time packets were received
+ */
+nsec_t now_realtime_nsec(void)
+{
+    struct timespec ts;
+
+    if (clock_override)
+        return clock_override() * NSEC_PER_USEC;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts_nsec(&ts);
+}
+
 int safe_atoul(const char *s, unsigned long *ret)
 {
     char *x = NULL;
@@ -102,3 +136,44 @@ int safe_atoi(const char *s, int *ret)
     *ret = (int) l;
     return 0;
 }
+
+int write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    while (len > 0) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+size_t rss_bytes(void)
+{
+    char buf[64];
+    unsigned long size, resident;
+    ssize_t r;
+    int fd;
+
+    fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (r <= 0)
+        return 0;
+    buf[r] = '\0';
+
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+        return 0;
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
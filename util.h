@@ -20,6 +20,7 @@
 
 #include <stdbool.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <time.h>
 
 #include "macro.h"
@@ -42,11 +43,24 @@ typedef uint64_t nsec_t;
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define streq(a,b) (strcmp((a),(b)) == 0)
 
-int safe_atoull(const char *s, unsigned long long *ret);
-int safe_atoul(const char *s, unsigned long *ret);
-int safe_atoi(const char *s, int *ret);
-usec_t now_usec(void);
-usec_t ts_usec(const struct timespec *ts);
+_public_ int safe_atoull(const char *s, unsigned long long *ret);
+_public_ int safe_atoul(const char *s, unsigned long *ret);
+_public_ int safe_atoi(const char *s, int *ret);
+_public_ usec_t now_usec(void);
+/*
+ * Replace the clock all the timing of the router is based on, so simulations
+ * can run deterministically or faster than real time: now_usec() returns
+ * @clock and now_realtime_nsec() the same time in ns. NULL restores the
+ * system clocks. Set it before creating the Mainloop.
+ */
+_public_ void set_clock(usec_t (*clock)(void));
+_public_ usec_t ts_usec(const struct timespec *ts);
+_public_ nsec_t now_realtime_nsec(void);
+_public_ nsec_t ts_nsec(const struct timespec *ts);
+/* write() all of @data, retrying on EINTR. Async-signal-safe */
+_public_ int write_all(int fd, const void *data, size_t len);
+/* Resident set size of the process, 0 if unknown */
+_public_ size_t rss_bytes(void);
 
 #ifdef __cplusplus
 }